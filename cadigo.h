@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
 #include <stdio.h>
@@ -217,9 +218,13 @@ void free_faces(Faces fs);
 void free_points(Points p);
 
 
+// Normals are optional, cad_compute_normals fills them in. Operations that
+// change the topology drop them, similar geometry keeps them up to date.
 typedef struct {
     Points points;
     Faces faces;
+    Points face_normals;   // one per face, empty when not cached
+    Points vertex_normals; // one per point, mean of the faces around it
 } CAD;
 
 void cad_free(CAD obj);
@@ -247,6 +252,13 @@ CAD* cad_catmull_clark3D(CAD* obj);
 CAD* cad_extrude(CAD* obj, double h);
 
 Vec3 cad_calculate_face_normal(CAD obj, size_t face_index);
+
+// Cached normals
+CAD* cad_compute_normals(CAD* obj);
+void cad_invalidate_normals(CAD* obj);
+bool cad_has_normals(CAD obj);
+Vec3 cad_face_normal(CAD obj, size_t face_index);    // cached if there are, computed if not
+Vec3 cad_vertex_normal(CAD obj, size_t point_index);
 // Operations - Booleans
 CAD* cad_substract(CAD* obj1, CAD* obj2);
 CAD cad_intersection(CAD obj);
@@ -261,6 +273,25 @@ typedef struct {
 
 Bounds cad_get_bounds(CAD obj);
 
+// Export - Triangles
+//
+// Flat arrays ready to upload as they are: every vertex is a position and a
+// normal in floats, every triangle three 32-bit indexes into them. Faces are
+// fan triangulated, so they have to be convex. Smooth shading shares a
+// vertex between all the faces around a point, flat shading only between
+// faces that face the same way.
+#define CAD_MESH_STRIDE 6 // floats per vertex: x, y, z, nx, ny, nz
+
+typedef struct {
+    float* vertices;
+    size_t vertex_count;
+    uint32_t* indexes;
+    size_t index_count;
+} TriangleMesh;
+
+TriangleMesh cad_to_triangle_mesh(CAD obj, bool smooth);
+void free_triangle_mesh(TriangleMesh mesh);
+
 typedef struct {
     size_t width;
     size_t height;
@@ -447,6 +478,8 @@ void free_points(Points p) {
 void cad_free(CAD obj) {
     free_points(obj.points);
     free_faces(obj.faces);
+    free_points(obj.face_normals);
+    free_points(obj.vertex_normals);
 }
 
 #define da_size(array) ((array.capacity) > 0 ? sizeof(array.items[0]) * (array.capacity) : 0)
@@ -643,21 +676,49 @@ Vec3 vec3_rotate_yaw(ang_t yaw, Vec3 v) {
     return vec3_color(v1.first, v1.second, v.z, v.color);
 }
 
+Vec3 vec3_rotate(Vec3 v, Vec3 angles) {
+    v = vec3_rotate_roll (degs2rads(angles.roll),  v);
+    v = vec3_rotate_pitch(degs2rads(angles.pitch), v);
+    v = vec3_rotate_yaw  (degs2rads(angles.yaw),   v);
+    return v;
+}
+
 CAD* cad_rotate(CAD* obj, Vec3 v) {
-    for (size_t i = 0; i < obj->points.count; ++i) {
-        obj->points.items[i] = vec3_rotate_roll (degs2rads(v.roll),  obj->points.items[i]);
-        obj->points.items[i] = vec3_rotate_pitch(degs2rads(v.pitch), obj->points.items[i]);
-        obj->points.items[i] = vec3_rotate_yaw  (degs2rads(v.yaw),   obj->points.items[i]);
-    }
+    for (size_t i = 0; i < obj->points.count; ++i)
+        obj->points.items[i] = vec3_rotate(obj->points.items[i], v);
+
+    // Normals turn with the object
+    for (size_t i = 0; i < obj->face_normals.count; ++i)
+        obj->face_normals.items[i] = vec3_rotate(obj->face_normals.items[i], v);
+    for (size_t i = 0; i < obj->vertex_normals.count; ++i)
+        obj->vertex_normals.items[i] = vec3_rotate(obj->vertex_normals.items[i], v);
     return obj;
 }
 
+void cad_vertex_normals_from_faces(CAD* obj);
+
 CAD* cad_scale(CAD* obj, Vec3 v) {
     for (size_t i=0; i < obj->points.count; ++i) {
         obj->points.items[i].x *= v.x;
         obj->points.items[i].y *= v.y;
         obj->points.items[i].z *= v.z;
     }
+
+    if (!cad_has_normals(*obj)) return obj;
+    if (v.x == 0 || v.y == 0 || v.z == 0) {
+        cad_invalidate_normals(obj);
+        return obj;
+    }
+    // Normals scale by the inverse, then go back to unit length. They follow
+    // the winding, so a mirroring scale flips them once more.
+    val_t sign = v.x*v.y*v.z < 0 ? -1 : 1;
+    for (size_t i = 0; i < obj->face_normals.count; ++i) {
+        Vec3 n = vec3_mult_s(vec3_div(obj->face_normals.items[i], v), sign);
+        val_t length = sqrt(n.x*n.x + n.y*n.y + n.z*n.z);
+        if (length > 0.0001) vec3_div_by_s(&n, length);
+        obj->face_normals.items[i] = n;
+    }
+    cad_vertex_normals_from_faces(obj);
     return obj;
 }
 
@@ -667,6 +728,10 @@ CAD* cad_scale_s(CAD* obj, val_t v) {
         obj->points.items[i].y *= v;
         obj->points.items[i].z *= v;
     }
+
+    // A uniform scale keeps the normals. A negative one turns the object
+    // inside out, but the normals follow the winding so they stay put.
+    if (v == 0) cad_invalidate_normals(obj);
     return obj;
 }
 
@@ -679,12 +744,20 @@ Face cad_copy_face(Face f) {
     return ret;
 }
 
+Points cad_clone_points(Points points) {
+    Points ret;
+    ret.count    = points.count;
+    ret.capacity = points.capacity;
+    ret.items    = (Vec3*)malloc(da_size(points));
+    memcpy(ret.items, points.items, da_size(points));
+    return ret;
+}
+
 CAD cad_clone(CAD obj) {
     CAD ret;
-    ret.points.count    = obj.points.count;
-    ret.points.capacity = obj.points.capacity;
-    ret.points.items    = (Vec3*)malloc(da_size(obj.points));
-    memcpy(ret.points.items, obj.points.items, da_size(obj.points));
+    ret.points         = cad_clone_points(obj.points);
+    ret.face_normals   = cad_clone_points(obj.face_normals);
+    ret.vertex_normals = cad_clone_points(obj.vertex_normals);
 
     ret.faces.count    = obj.faces.count;
     ret.faces.capacity = obj.faces.capacity;
@@ -697,7 +770,8 @@ CAD cad_clone(CAD obj) {
 void cad_copy_face_into(Face f, Face* target) {
     target->count = f.count;
     if (target->count >= target->capacity) {
-        target->capacity = target->capacity == 0 ? DA_INIT_CAP : target->capacity*2;
+        while (target->count >= target->capacity)
+            target->capacity = target->capacity == 0 ? DA_INIT_CAP : target->capacity*2;
         target->items = realloc(target->items, target->capacity*sizeof(*target->items));
     }
     memcpy(target->items, f.items, sizeof(target->items[0])*target->count);
@@ -707,7 +781,8 @@ void cad_clone_into(CAD obj, CAD* target) {
     target->points.count = obj.points.count;
 
     if (target->points.count >= target->points.capacity) {
-        target->points.capacity = target->points.capacity == 0 ? DA_INIT_CAP : target->points.capacity*2;
+        while (target->points.count >= target->points.capacity)
+            target->points.capacity = target->points.capacity == 0 ? DA_INIT_CAP : target->points.capacity*2;
         target->points.items = realloc(target->points.items, target->points.capacity*sizeof(*target->points.items));
     }
     memcpy(target->points.items, obj.points.items, sizeof(target->points.items[0])*target->points.count);
@@ -715,11 +790,21 @@ void cad_clone_into(CAD obj, CAD* target) {
 
     target->faces.count = obj.faces.count;
     if (target->faces.count >= target->faces.capacity) {
-        target->faces.capacity = target->faces.capacity == 0 ? DA_INIT_CAP : target->faces.capacity*2;
+        size_t old_capacity = target->faces.capacity;
+        while (target->faces.count >= target->faces.capacity)
+            target->faces.capacity = target->faces.capacity == 0 ? DA_INIT_CAP : target->faces.capacity*2;
         target->faces.items = realloc(target->faces.items, target->faces.capacity*sizeof(*target->faces.items));
+        // The new faces own nothing yet
+        memset(&target->faces.items[old_capacity], 0, (target->faces.capacity - old_capacity)*sizeof(*target->faces.items));
     }
     for (size_t i = 0; i < obj.faces.count; ++i)
         cad_copy_face_into(obj.faces.items[i], &target->faces.items[i]);
+
+    cad_invalidate_normals(target);
+    for (size_t i = 0; i < obj.face_normals.count; ++i)
+        da_append(&target->face_normals, obj.face_normals.items[i]);
+    for (size_t i = 0; i < obj.vertex_normals.count; ++i)
+        da_append(&target->vertex_normals, obj.vertex_normals.items[i]);
 }
 
 typedef struct {
@@ -753,6 +838,7 @@ CAD* cad_split_edge(CAD* obj, IndexPair edge) {
             }
         }
     }
+    cad_invalidate_normals(obj);
     return obj;
 }
 
@@ -1013,6 +1099,7 @@ CAD* cad_catmull_clark(CAD* obj) {
     free_faces(obj->faces);
     obj->faces = new_obj.faces;
     obj->points = new_obj.points;
+    cad_invalidate_normals(obj);
     return obj;
 }
 
@@ -1060,6 +1147,7 @@ CAD* make_little_faces_around(CAD* obj) {
 
         da_append(&obj->faces, new_face);
     }
+    cad_invalidate_normals(obj);
     return obj;
 }
 
@@ -1070,6 +1158,7 @@ CAD* cad_clone_face_with_points(CAD* obj, size_t face_index) {
         new_face.items[i] = obj->points.count-1;
     }
     da_append(&obj->faces, new_face);
+    cad_invalidate_normals(obj);
     return obj;
 }
 
@@ -1125,6 +1214,7 @@ CAD* cad_inset_face(CAD* obj, size_t face_index, val_t amount) {
     }
     free_face(obj->faces.items[face_index]);
     da_delete(&obj->faces, face_index);
+    cad_invalidate_normals(obj);
     return obj;
 }
 
@@ -1153,6 +1243,150 @@ Vec3 cad_calculate_face_normal(CAD obj, size_t face_index) {
     return normal;
 }
 
+void cad_invalidate_normals(CAD* obj) {
+    obj->face_normals.count = 0;
+    obj->vertex_normals.count = 0;
+}
+
+bool cad_has_normals(CAD obj) {
+    return obj.faces.count > 0 && obj.face_normals.count == obj.faces.count;
+}
+
+// Faces with less than 3 points get a zero normal
+CAD* cad_compute_normals(CAD* obj) {
+    cad_invalidate_normals(obj);
+    for (size_t i = 0; i < obj->faces.count; ++i) {
+        Vec3 normal = obj->faces.items[i].count >= 3 ? cad_calculate_face_normal(*obj, i) : vec3(0, 0, 0);
+        da_append(&obj->face_normals, normal);
+    }
+    cad_vertex_normals_from_faces(obj);
+    return obj;
+}
+
+void cad_vertex_normals_from_faces(CAD* obj) {
+    obj->vertex_normals.count = 0;
+    for (size_t i = 0; i < obj->points.count; ++i)
+        da_append(&obj->vertex_normals, vec3(0, 0, 0));
+
+    for (size_t i = 0; i < obj->faces.count; ++i) {
+        Face f = obj->faces.items[i];
+        for (size_t j = 0; j < f.count; ++j)
+            vec3_add_to(&obj->vertex_normals.items[f.items[j]], obj->face_normals.items[i]);
+    }
+
+    for (size_t i = 0; i < obj->points.count; ++i) {
+        Vec3* n = &obj->vertex_normals.items[i];
+        val_t length = sqrt(n->x*n->x + n->y*n->y + n->z*n->z);
+        if (length > 0.0001) vec3_div_by_s(n, length);
+    }
+}
+
+Vec3 cad_face_normal(CAD obj, size_t face_index) {
+    if (cad_has_normals(obj)) return obj.face_normals.items[face_index];
+    return cad_calculate_face_normal(obj, face_index);
+}
+
+Vec3 cad_vertex_normal(CAD obj, size_t point_index) {
+    assert(point_index < obj.points.count);
+    if (cad_has_normals(obj)) return obj.vertex_normals.items[point_index];
+
+    Vec3 sum = vec3(0, 0, 0);
+    for (size_t i = 0; i < obj.faces.count; ++i) {
+        Face f = obj.faces.items[i];
+        if (f.count < 3) continue;
+        for (size_t j = 0; j < f.count; ++j) {
+            if (f.items[j] != point_index) continue;
+            vec3_add_to(&sum, cad_calculate_face_normal(obj, i));
+            break;
+        }
+    }
+    val_t length = sqrt(sum.x*sum.x + sum.y*sum.y + sum.z*sum.z);
+    if (length > 0.0001) vec3_div_by_s(&sum, length);
+    return sum;
+}
+
+TriangleMesh cad_to_triangle_mesh(CAD obj, bool smooth) {
+    // Work on normals of our own if the object doesn't have them cached
+    bool cached = cad_has_normals(obj);
+    if (!cached) {
+        obj.face_normals = (Points){0};
+        obj.vertex_normals = (Points){0};
+        cad_compute_normals(&obj);
+    }
+
+    size_t corners = 0, triangles = 0;
+    for (size_t i = 0; i < obj.faces.count; ++i) {
+        if (obj.faces.items[i].count < 3) continue;
+        corners += obj.faces.items[i].count;
+        triangles += obj.faces.items[i].count - 2;
+    }
+
+    TriangleMesh mesh = {
+        .vertices = malloc(corners*CAD_MESH_STRIDE*sizeof(float)),
+        .indexes  = malloc(triangles*3*sizeof(uint32_t)),
+    };
+
+    // Vertexes made for each point, chained, so a corner can find one with
+    // the same normal
+    size_t* first = malloc(obj.points.count*sizeof(size_t));
+    size_t* next  = malloc(corners*sizeof(size_t));
+    for (size_t i = 0; i < obj.points.count; ++i) first[i] = SIZE_MAX;
+
+    uint32_t* face_vertices = NULL;
+    size_t face_capacity = 0;
+
+    for (size_t i = 0; i < obj.faces.count; ++i) {
+        Face f = obj.faces.items[i];
+        if (f.count < 3) continue;
+        if (f.count > face_capacity) {
+            face_capacity = f.count;
+            face_vertices = realloc(face_vertices, face_capacity*sizeof(uint32_t));
+        }
+
+        for (size_t j = 0; j < f.count; ++j) {
+            size_t point = f.items[j];
+            Vec3 p = obj.points.items[point];
+            Vec3 n = smooth ? obj.vertex_normals.items[point] : obj.face_normals.items[i];
+            float vertex[CAD_MESH_STRIDE] = {p.x, p.y, p.z, n.x, n.y, n.z};
+
+            size_t found = SIZE_MAX;
+            for (size_t v = first[point]; v != SIZE_MAX; v = next[v]) {
+                if (memcmp(&mesh.vertices[v*CAD_MESH_STRIDE], vertex, sizeof(vertex)) == 0) {
+                    found = v;
+                    break;
+                }
+            }
+            if (found == SIZE_MAX) {
+                found = mesh.vertex_count++;
+                memcpy(&mesh.vertices[found*CAD_MESH_STRIDE], vertex, sizeof(vertex));
+                next[found] = first[point];
+                first[point] = found;
+            }
+            face_vertices[j] = (uint32_t)found;
+        }
+
+        for (size_t j = 1; j+1 < f.count; ++j) {
+            mesh.indexes[mesh.index_count++] = face_vertices[0];
+            mesh.indexes[mesh.index_count++] = face_vertices[j];
+            mesh.indexes[mesh.index_count++] = face_vertices[j+1];
+        }
+    }
+
+    free(face_vertices);
+    free(next);
+    free(first);
+    if (!cached) {
+        free_points(obj.face_normals);
+        free_points(obj.vertex_normals);
+    }
+    return mesh;
+}
+
+void free_triangle_mesh(TriangleMesh mesh) {
+    free(mesh.vertices);
+    free(mesh.indexes);
+}
+
 void vec3_print(Vec3 v) {
     printf("<%"VAL_FMT", %"VAL_FMT", %"VAL_FMT">", v.x, v.y, v.z);
 }
@@ -1220,6 +1454,7 @@ CAD* cad_hotpoints_subdivision(CAD* obj) {
     free_points (obj->points);
     obj->faces.items[0] = f;
     obj->points = points;
+    cad_invalidate_normals(obj);
     return obj;
 }
 
@@ -1246,7 +1481,7 @@ Vec3 cad_get_size(CAD obj) {
 }
 
 CAD cad_curve(Points points) {
-    CAD ret;
+    CAD ret = {0};
     ret.faces  = (Faces){0};
     // TODO should clone points maybe?
     ret.points = points;
@@ -1281,7 +1516,7 @@ Face cad_alloc_face(size_t count) {
 }
 
 CAD cad_xy_curve_from_function(val_t (*func)(val_t), val_t from, val_t to, size_t nsteps) {
-    CAD ret;
+    CAD ret = {0};
     ret.faces  = (Faces){0};
     ret.points = cad_alloc_points(nsteps+1);
     for (size_t step = 0; step <= nsteps; ++step) {
@@ -1297,6 +1532,7 @@ CAD* cad_curve_to_polygon(CAD* curve) {
          f.items[i] = i;
     curve->faces = cad_alloc_faces(1);
     curve->faces.items[0] = f;
+    cad_invalidate_normals(curve);
     return curve;
 }
 
@@ -1642,6 +1878,7 @@ CAD* cad_substract(CAD* obj1, CAD* obj2) {
 
     }
 
+    cad_invalidate_normals(obj1);
     return obj1;
 
 }
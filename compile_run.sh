@@ -1,3 +1,3 @@
 #!/bin/bash
 
-gcc symc.c -o symc -lX11 -lGL -lXrandr -lm -I../cadigo/src -O3 && ./symc
+gcc symc.c -o symc -lX11 -lGL -lEGL -lXrandr -lz -lm -I../cadigo/src -O3 -fno-math-errno && ./symc
@@ -3,6 +3,20 @@
 #include <time.h>
 #include <math.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <zlib.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
 
 typedef float val_t;
 #define VAL_FMT "f"
@@ -10,13 +24,18 @@ typedef float val_t;
 #define CADIGO_IMPLEMENTATION
 #include "cadigo.h"
 
+#define GL_GLEXT_PROTOTYPES
 #define RGFW_IMPLEMENTATION
 #include "RGFW.h"
 
 #define DEG2RAD 3.14/180.0
 
+static inline double cad_viz_focal(double fovY) {
+    return 1 / (cos(fovY) * sin(fovY));
+}
+
 static inline void cad_viz_glPerspective(double fovY, double aspect, double zNear, double zFar) {
-    const double f = 1 / (cos(fovY) * sin(fovY));
+    const double f = cad_viz_focal(fovY);
     float projectionMatrix[16] = {0};
     
     projectionMatrix[0] = f / aspect;
@@ -28,218 +47,3270 @@ static inline void cad_viz_glPerspective(double fovY, double aspect, double zNea
     glMultMatrixf(projectionMatrix);
 }
 
-#define CORE_N 4
-#define FAR_PLANET_RES 1
-#define NEAR_PLANET_RES 2
-#define LOD_LIMIT 800
-#define PLANET_COUNT 5000
+#define CORE_N 4
+#define PLANET_LOD_LEVELS 5   // Catmull-Clark subdivisions 0 to 4
+#define LOD_ERROR_PIXELS 0.5  // how far a mesh may be off the finest one on screen
+#define LOD_HYSTERESIS 0.7    // a coarser level has to fit this far under the limit
+#define IMPOSTOR_PIXELS 6     // smaller bodies on screen are drawn as shaded points
+#define AMBIENT_LIGHT 1.5
+#define BRIGHTNESS 0.20
+#define FOV_Y 60
+#define FRAME_WIDTH 800
+#define FRAME_HEIGHT 450
+#define PLANET_COUNT 5000
+
+#define MAX_X 2000.0L
+#define MAX_Y 2000.0L
+#define MAX_Z 1000.0L
+
+#define MAX_RADIOUS 10.0L
+
+#define MAX_DENSITY 2000000000
+#define MIN_DENSITY 10
+
+#define MAX_VELOCITY 0.01
+
+#define SEED 22389238
+
+clock_t __perf_start;
+#define PERF_START() __perf_start = clock()
+#define PERF_END(str, scale) printf("Time taken by " str ": %f\n", ((double)(clock() - __perf_start)) / CLOCKS_PER_SEC * (scale))
+
+// Just the coordinates, a cadigo Vec3 also carries a mark and a color
+typedef struct {
+    val_t x, y, z;
+} Vec3p;
+
+static inline Vec3 vec3_unpack(Vec3p v) { return vec3(v.x, v.y, v.z); }
+static inline Vec3p vec3_pack(Vec3 v)   { return (Vec3p){v.x, v.y, v.z}; }
+
+// What the physics loops touch, 32 bytes per body. Everything else is in
+// PlanetInfo, at the same index.
+typedef struct {
+    Vec3p position;
+    val_t mass; // 0 once merged into another body
+    Vec3p velocity;
+    val_t radious;
+} Planet;
+
+typedef struct {
+    Vec3 color;
+    int id;          // stays the same when the arrays get reordered
+    int merged_into; // id of the body that took this one in, -1 while active
+    int merges;      // bodies taken in
+} PlanetInfo;
+
+static inline bool planet_active(const Planet* planet) {
+    return planet->mass > 0;
+}
+
+#define G 6.67430e-11 
+
+#define CAM_VELOCITY 0.1
+
+// The simulation always advances in steps of SIM_DT, frames just decide how
+// many of them to run. At the default warp that is one step per 60 Hz frame.
+#define SIM_DT (1000.0/60.0)
+#define TIME_WARPING 1000.0
+#define MAX_STEPS_PER_FRAME 8
+
+val_t dt = SIM_DT;
+
+uint64_t seed = SEED;
+
+// Every phase reads the snapshot in ref_planets and writes working_planets,
+// then the two swap roles. Nothing is copied on the main thread, the workers
+// carry their own slice over at the start of each phase.
+Planet planet_buffers[2][PLANET_COUNT];
+Planet* working_planets = planet_buffers[0];
+Planet* ref_planets = planet_buffers[1];
+
+// Only written on merges and sorts, so it isn't double buffered
+PlanetInfo planet_info[PLANET_COUNT];
+int planet_slot[PLANET_COUNT]; // id -> index into the planet arrays
+
+static inline void swap_planet_buffers() {
+    Planet* latest = working_planets;
+    working_planets = ref_planets;
+    ref_planets = latest;
+}
+
+// What the renderer needs of a body, by id. The last two published states
+// are kept, frames fall between steps and the renderer blends them. Only the
+// first step of a batch publishes, so the renderer can read them while the
+// workers run the rest of it.
+typedef struct {
+    bool active;
+    Vec3 position;
+    Vec3 color;
+    val_t radious;
+} RenderBody;
+
+RenderBody render_bodies[2][PLANET_COUNT];
+int render_published; // index of the latest state in render_bodies
+bool render_first;
+
+// Each worker covers a quarter of the ids, not of its rank slice, since
+// rank 0 renders every body. The snapshot is by id so it stays put when the
+// bodies are sorted.
+void render_snapshot(int thread_index) {
+    int from = (int)((long)thread_index*PLANET_COUNT/CORE_N);
+    int to   = (int)((long)(thread_index+1)*PLANET_COUNT/CORE_N);
+    RenderBody* snapshot = render_bodies[render_published];
+    for (int id = from; id < to; ++id) {
+        int i = planet_slot[id];
+        Planet* planet = &ref_planets[i];
+        RenderBody body = {planet_active(planet), vec3_unpack(planet->position), planet_info[i].color, planet->radious};
+        snapshot[id] = body;
+        if (render_first) render_bodies[1-render_published][id] = body;
+    }
+}
+
+// Steps the workers run per batch without the main thread. It stays at 1
+// unless a target frame rate is set, then it follows how long steps take.
+#define MAX_BATCH_STEPS 1024
+
+int batch_steps = 1;
+size_t batch_first_step;
+double batch_seconds;
+double step_seconds; // the main thread's copy, per step of the last batch
+
+typedef struct {
+    int thread_index;
+    int from;
+    int to;
+} PlanetsThreadData;
+
+// Philox4x32-10 counter based generator (Salmon et al. 2011).
+//
+// Every body draws from its own stream, keyed by the seed and indexed by the
+// body, so any thread can generate any slice and the result doesn't depend on
+// how the bodies were split between threads.
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+
+typedef struct {
+    uint32_t key[2];
+    uint32_t stream;
+    uint32_t counter;
+    uint32_t block[4];
+    int used;
+} RNG;
+
+static inline void philox4x32_10(uint32_t ctr[4], uint32_t k0, uint32_t k1) {
+    for (int round = 0; round < 10; ++round) {
+        uint64_t p0 = (uint64_t)PHILOX_M0 * ctr[0];
+        uint64_t p1 = (uint64_t)PHILOX_M1 * ctr[2];
+        uint32_t c1 = ctr[1], c3 = ctr[3];
+        ctr[0] = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+        ctr[1] = (uint32_t)p1;
+        ctr[2] = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+        ctr[3] = (uint32_t)p0;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+}
+
+RNG rng_stream(uint64_t seed, uint32_t stream) {
+    return (RNG){.key = {(uint32_t)seed, (uint32_t)(seed >> 32)}, .stream = stream, .used = 4};
+}
+
+uint32_t rng_next(RNG* rng) {
+    if (rng->used == 4) {
+        rng->block[0] = rng->counter++;
+        rng->block[1] = rng->stream;
+        rng->block[2] = 0;
+        rng->block[3] = 0;
+        philox4x32_10(rng->block, rng->key[0], rng->key[1]);
+        rng->used = 0;
+    }
+    return rng->block[rng->used++];
+}
+
+// Uniform in [0, 1)
+static inline val_t rng_val(RNG* rng) {
+    return (rng_next(rng) >> 8) * (1.0f/16777216.0f);
+}
+
+// Scenarios
+
+// The gravity loop averages the force over PLANET_COUNT, so this is the
+// constant the bodies actually feel
+#define G_EFFECTIVE (G / PLANET_COUNT)
+
+#define PLUMMER_RADIOUS (MAX_Z/4)
+#define PLUMMER_CUTOFF 10            // in plummer radii
+
+#define DISK_INNER_RADIOUS 100
+#define DISK_OUTER_RADIOUS (MAX_X/2)
+#define DISK_THICKNESS 20
+#define DISK_STAR_MASS_RATIO 1.0     // of the whole disk's mass
+#define DISK_STAR_RADIOUS_RATIO 4.0  // of a regular planet's radious
+
+#define BINARY_MIN_SEPARATION 3.0    // in planet diameters
+#define BINARY_MAX_SEPARATION 6.0
+
+typedef enum {
+    SCENARIO_UNIFORM,
+    SCENARIO_PLUMMER,
+    SCENARIO_DISK,
+    SCENARIO_BINARIES,
+    SCENARIO_COUNT
+} Scenario;
+
+static_assert(SCENARIO_COUNT == 4 && "Scenario count changed, add its name");
+
+char* scenario_names[SCENARIO_COUNT] = {
+    [SCENARIO_UNIFORM ] = "uniform",
+    [SCENARIO_PLUMMER ] = "plummer",
+    [SCENARIO_DISK    ] = "disk",
+    [SCENARIO_BINARIES] = "binaries",
+};
+
+Scenario scenario = SCENARIO_UNIFORM;
+
+val_t initial_radious;
+val_t initial_density;
+
+static inline Vec3 vec3_cross(Vec3 a, Vec3 b) {
+    return vec3(a.y*b.z - a.z*b.y, a.z*b.x - a.x*b.z, a.x*b.y - a.y*b.x);
+}
+
+static inline val_t vec3_length(Vec3 v) {
+    return sqrt(v.x*v.x + v.y*v.y + v.z*v.z);
+}
+
+Vec3 rng_direction(RNG* rng) {
+    val_t z = 1 - 2*rng_val(rng);
+    val_t phi = 2*M_PI*rng_val(rng);
+    val_t r = sqrt(max(0, 1 - z*z));
+    return vec3(r*cos(phi), r*sin(phi), z);
+}
+
+// Aarseth, Henon & Wielen (1974). Positions relative to the center.
+void plummer_sample(RNG* rng, val_t total_mass, Vec3* position, Vec3* velocity) {
+    val_t r;
+    do {
+        val_t x = rng_val(rng);
+        r = PLUMMER_RADIOUS / sqrt(pow(x, -2.0/3.0) - 1);
+    } while (!(r < PLUMMER_CUTOFF*PLUMMER_RADIOUS));
+    *position = vec3_mult_s(rng_direction(rng), r);
+
+    // von Neumann rejection for q = v/v_escape
+    val_t q, y;
+    do {
+        q = rng_val(rng);
+        y = rng_val(rng) * 0.1;
+    } while (y > q*q * pow(1 - q*q, 3.5));
+
+    val_t escape = sqrt(2*G_EFFECTIVE*total_mass) * pow(r*r + PLUMMER_RADIOUS*PLUMMER_RADIOUS, -0.25);
+    *velocity = vec3_mult_s(rng_direction(rng), q*escape);
+}
+
+void init_planet(int i) {
+    RNG rng = rng_stream(seed, i);
+
+    Vec3 center = vec3(MAX_X/2, MAX_Y/2, MAX_Z/2);
+    val_t mass = initial_radious * initial_density;
+    val_t total_mass = mass * PLANET_COUNT;
+
+    Planet* planet = &working_planets[i];
+    planet->radious = initial_radious;
+    planet->mass = mass;
+
+    Vec3 position = vec3(0, 0, 0);
+    Vec3 velocity = vec3(0, 0, 0);
+
+    switch (scenario) {
+        case SCENARIO_UNIFORM:
+            position.x = rng_val(&rng) * MAX_X;
+            position.y = rng_val(&rng) * MAX_Y;
+            position.z = rng_val(&rng) * MAX_Z;
+
+            velocity.x = (rng_val(&rng)-0.5L)*2*MAX_VELOCITY;
+            velocity.y = (rng_val(&rng)-0.5L)*2*MAX_VELOCITY;
+            velocity.z = (rng_val(&rng)-0.5L)*2*MAX_VELOCITY;
+            break;
+
+        case SCENARIO_PLUMMER:
+            plummer_sample(&rng, total_mass, &position, &velocity);
+            vec3_add_to(&position, center);
+            break;
+
+        case SCENARIO_DISK: {
+            // Body 0 is the star, everything else is on a circular orbit around
+            // the mass enclosed by it
+            val_t star_mass = total_mass * DISK_STAR_MASS_RATIO;
+            if (i == 0) {
+                planet->mass = star_mass;
+                planet->radious = initial_radious * DISK_STAR_RADIOUS_RATIO;
+                position = center;
+                velocity = vec3(0, 0, 0);
+                break;
+            }
+
+            val_t inner2 = DISK_INNER_RADIOUS*DISK_INNER_RADIOUS;
+            val_t outer2 = DISK_OUTER_RADIOUS*DISK_OUTER_RADIOUS;
+            val_t inside = rng_val(&rng);
+            val_t r = sqrt(inner2 + inside*(outer2 - inner2));
+            val_t angle = 2*M_PI*rng_val(&rng);
+
+            position = vec3_add(center, vec3(r*cos(angle), r*sin(angle), (rng_val(&rng)-0.5)*DISK_THICKNESS));
+
+            val_t speed = sqrt(G_EFFECTIVE * (star_mass + inside*total_mass) / r);
+            velocity = vec3(-sin(angle)*speed, cos(angle)*speed, 0);
+            break;
+        }
+
+        case SCENARIO_BINARIES: {
+            // Pairs share a stream past the ones used by the bodies, so both
+            // members agree on their orbit no matter which thread makes them
+            int pair = i/2;
+            RNG pair_rng = rng_stream(seed, PLANET_COUNT + 1 + pair);
+
+            Vec3 pair_position, pair_velocity;
+            plummer_sample(&pair_rng, total_mass, &pair_position, &pair_velocity);
+            vec3_add_to(&pair_position, center);
+
+            position = pair_position;
+            velocity = pair_velocity;
+            if (2*pair + 1 >= PLANET_COUNT) break; // odd one out stays single
+
+            val_t diameter = 2*initial_radious;
+            val_t separation = diameter * (BINARY_MIN_SEPARATION + (BINARY_MAX_SEPARATION - BINARY_MIN_SEPARATION)*rng_val(&pair_rng));
+            Vec3 axis = rng_direction(&pair_rng);
+            Vec3 tangent = vec3_cross(axis, fabs(axis.x) < 0.9 ? vec3(1, 0, 0) : vec3(0, 1, 0));
+            vec3_div_by_s(&tangent, vec3_length(tangent));
+
+            // Equal masses on a circular orbit around the pair's center
+            val_t speed = sqrt(G_EFFECTIVE * 2*mass / separation) / 2;
+            val_t side = i % 2 == 0 ? 1 : -1;
+            vec3_add_to(&position, vec3_mult_s(axis, side*separation/2));
+            vec3_add_to(&velocity, vec3_mult_s(tangent, side*speed));
+            break;
+        }
+
+        default:
+            assert(false && "unreachable");
+    }
+
+    planet->position = vec3_pack(position);
+    planet->velocity = vec3_pack(velocity);
+
+    PlanetInfo* info = &planet_info[i];
+    info->color.x = rng_val(&rng);
+    info->color.y = rng_val(&rng);
+    info->color.z = rng_val(&rng);
+    info->id = i;
+    info->merged_into = -1;
+    info->merges = 0;
+}
+
+void init_planets(int from, int to) {
+    for (int i = from; i < to; ++i) {
+        init_planet(i);
+        planet_slot[i] = i;
+    }
+}
+
+pthread_barrier_t init_barrier;
+pthread_barrier_t end_barrier;
+pthread_barrier_t start_collision_barrier;
+pthread_barrier_t collision_barrier;
+pthread_barrier_t updated_ref_barrier;
+pthread_barrier_t published_barrier;
+pthread_barrier_t step_barrier;
+pthread_barrier_t bvh_barrier;
+pthread_barrier_t sort_barrier;
+pthread_barrier_t gravity_barrier;
+
+// Bounding volume hierarchy over the planet spheres.
+//
+// The top CORE_N-1 nodes split the bodies into one subtree per worker, every
+// worker then builds and refits its own subtree in its own slice of the node
+// pool, so no locking is needed. Nodes are allocated in pre-order, children
+// always come after their parent, which lets the refit walk a pool backwards.
+
+#define BVH_LEAF_SIZE 4
+#define BVH_STACK_SIZE 64
+#define BVH_REBUILD_RATIO 1.5   // rebuild when the refitted cost grows this much
+#define BVH_TOP_NODES (CORE_N - 1)
+#define BVH_NODE_COUNT (BVH_TOP_NODES + 2*PLANET_COUNT + CORE_N)
+
+#define VEC3_AXIS(v, axis) ((axis) == 0 ? (v).x : (axis) == 1 ? (v).y : (v).z)
+
+typedef struct {
+    val_t min[3];
+    val_t max[3];
+} AABB;
+
+typedef struct {
+    AABB box;
+    int left;   // -1 for leaves
+    int right;
+    int first;  // leaves: range into BVH.indexes
+    int count;
+} BVHNode;
+
+typedef struct {
+    BVHNode nodes[BVH_NODE_COUNT];
+    int indexes[PLANET_COUNT];
+    int root;
+    int count;
+
+    int subtree_from[CORE_N];
+    int subtree_to[CORE_N];
+    int subtree_node_count[CORE_N];
+    val_t subtree_cost[CORE_N];
+
+    val_t built_cost;
+    val_t cost;
+    bool needs_rebuild;
+
+    val_t sweep; // leaves bound each sphere over [0, sweep] of linear motion
+} BVH;
+
+BVH planets_bvh = {.needs_rebuild = true};
+
+static inline AABB aabb_empty() {
+    return (AABB){.min = {INFINITY, INFINITY, INFINITY}, .max = {-INFINITY, -INFINITY, -INFINITY}};
+}
+
+static inline AABB aabb_sphere(Vec3 center, val_t radious) {
+    return (AABB){
+        .min = {center.x - radious, center.y - radious, center.z - radious},
+        .max = {center.x + radious, center.y + radious, center.z + radious},
+    };
+}
+
+static inline AABB aabb_union(AABB a, AABB b) {
+    for (int axis = 0; axis < 3; ++axis) {
+        a.min[axis] = min(a.min[axis], b.min[axis]);
+        a.max[axis] = max(a.max[axis], b.max[axis]);
+    }
+    return a;
+}
+
+static inline bool aabb_overlap(AABB a, AABB b) {
+    return a.min[0] <= b.max[0] && a.max[0] >= b.min[0]
+        && a.min[1] <= b.max[1] && a.max[1] >= b.min[1]
+        && a.min[2] <= b.max[2] && a.max[2] >= b.min[2];
+}
+
+static inline val_t aabb_area(AABB a) {
+    if (a.min[0] > a.max[0]) return 0;
+    val_t dx = a.max[0] - a.min[0];
+    val_t dy = a.max[1] - a.min[1];
+    val_t dz = a.max[2] - a.min[2];
+    return 2*(dx*dy + dy*dz + dz*dx);
+}
+
+static inline AABB bvh_planet_box(const BVH* bvh, const Planet* planet) {
+    if (!planet_active(planet)) return aabb_empty();
+    Vec3 position = vec3_unpack(planet->position);
+    AABB start = aabb_sphere(position, planet->radious);
+    if (bvh->sweep <= 0) return start;
+    return aabb_union(start, aabb_sphere(vec3_add(position, vec3_mult_s(vec3_unpack(planet->velocity), bvh->sweep)), planet->radious));
+}
+
+// Sphere around a body over its sweep, what the radius and pair queries test
+static inline void bvh_planet_sphere(const BVH* bvh, const Planet* planet, Vec3* center, val_t* radious) {
+    Vec3 half_sweep = vec3_mult_s(vec3_unpack(planet->velocity), bvh->sweep/2);
+    *center = vec3_add(vec3_unpack(planet->position), half_sweep);
+    *radious = planet->radious + vec3_length(half_sweep);
+}
+
+static inline int bvh_node_offset(BVH* bvh, int subtree) {
+    return BVH_TOP_NODES + 2*bvh->subtree_from[subtree] + subtree;
+}
+
+// Quickselect: leaves indexes[k] at its sorted position along axis
+void bvh_select(int* indexes, int count, int k, const Planet* planets, int axis) {
+    int lo = 0, hi = count - 1;
+    while (lo < hi) {
+        val_t pivot = VEC3_AXIS(planets[indexes[(lo + hi)/2]].position, axis);
+        int i = lo, j = hi;
+        while (i <= j) {
+            while (VEC3_AXIS(planets[indexes[i]].position, axis) < pivot) ++i;
+            while (VEC3_AXIS(planets[indexes[j]].position, axis) > pivot) --j;
+            if (i <= j) {
+                int t = indexes[i]; indexes[i] = indexes[j]; indexes[j] = t;
+                ++i; --j;
+            }
+        }
+        if (k <= j) hi = j;
+        else if (k >= i) lo = i;
+        else break;
+    }
+}
+
+int bvh_split_axis(const int* indexes, int count, const Planet* planets) {
+    AABB centroids = aabb_empty();
+    for (int i = 0; i < count; ++i) centroids = aabb_union(centroids, aabb_sphere(vec3_unpack(planets[indexes[i]].position), 0));
+
+    int axis = 0;
+    for (int a = 1; a < 3; ++a)
+        if (centroids.max[a] - centroids.min[a] > centroids.max[axis] - centroids.min[axis]) axis = a;
+    return axis;
+}
+
+// Splits indexes[from, to) between threads [thread_from, thread_to), returns the node for that range
+int bvh_split_top(BVH* bvh, const Planet* planets, int from, int to, int thread_from, int thread_to, int* next_top) {
+    int threads = thread_to - thread_from;
+    if (threads == 1) {
+        bvh->subtree_from[thread_from] = from;
+        bvh->subtree_to[thread_from] = to;
+        return bvh_node_offset(bvh, thread_from);
+    }
+
+    int node = (*next_top)++;
+    int left_threads = threads/2;
+    int middle = from + (int)((long)(to - from) * left_threads / threads);
+    if (middle > from && middle < to) {
+        int axis = bvh_split_axis(&bvh->indexes[from], to - from, planets);
+        bvh_select(&bvh->indexes[from], to - from, middle - from, planets, axis);
+    }
+
+    bvh->nodes[node].left  = bvh_split_top(bvh, planets, from,   middle, thread_from,                thread_from + left_threads, next_top);
+    bvh->nodes[node].right = bvh_split_top(bvh, planets, middle, to,     thread_from + left_threads, thread_to,                  next_top);
+    bvh->nodes[node].first = from;
+    bvh->nodes[node].count = to - from;
+    return node;
+}
+
+void bvh_partition(BVH* bvh, const Planet* planets) {
+    bvh->count = 0;
+    for (int i = 0; i < PLANET_COUNT; ++i)
+        if (planet_active(&planets[i])) bvh->indexes[bvh->count++] = i;
+
+    int next_top = 0;
+    bvh->root = bvh_split_top(bvh, planets, 0, bvh->count, 0, CORE_N, &next_top);
+}
+
+int bvh_build_node(BVH* bvh, const Planet* planets, int from, int to, int* next_node, val_t* cost) {
+    int node_index = (*next_node)++;
+    BVHNode* node = &bvh->nodes[node_index];
+    node->first = from;
+    node->count = to - from;
+
+    if (to - from <= BVH_LEAF_SIZE) {
+        node->left = node->right = -1;
+        node->box = aabb_empty();
+        for (int i = from; i < to; ++i) node->box = aabb_union(node->box, bvh_planet_box(bvh, &planets[bvh->indexes[i]]));
+        return node_index;
+    }
+
+    int axis = bvh_split_axis(&bvh->indexes[from], to - from, planets);
+    int middle = (from + to)/2;
+    bvh_select(&bvh->indexes[from], to - from, middle - from, planets, axis);
+
+    node->left  = bvh_build_node(bvh, planets, from, middle, next_node, cost);
+    node->right = bvh_build_node(bvh, planets, middle, to,   next_node, cost);
+    node->box = aabb_union(bvh->nodes[node->left].box, bvh->nodes[node->right].box);
+    *cost += aabb_area(node->box);
+    return node_index;
+}
+
+void bvh_build_subtree(BVH* bvh, const Planet* planets, int subtree) {
+    int offset = bvh_node_offset(bvh, subtree);
+    int next_node = offset;
+    bvh->subtree_cost[subtree] = 0;
+    bvh_build_node(bvh, planets, bvh->subtree_from[subtree], bvh->subtree_to[subtree], &next_node, &bvh->subtree_cost[subtree]);
+    bvh->subtree_node_count[subtree] = next_node - offset;
+}
+
+void bvh_refit_subtree(BVH* bvh, const Planet* planets, int subtree) {
+    int offset = bvh_node_offset(bvh, subtree);
+    val_t cost = 0;
+    for (int i = offset + bvh->subtree_node_count[subtree] - 1; i >= offset; --i) {
+        BVHNode* node = &bvh->nodes[i];
+        if (node->left < 0) {
+            node->box = aabb_empty();
+            for (int j = node->first; j < node->first + node->count; ++j)
+                node->box = aabb_union(node->box, bvh_planet_box(bvh, &planets[bvh->indexes[j]]));
+        } else {
+            node->box = aabb_union(bvh->nodes[node->left].box, bvh->nodes[node->right].box);
+            cost += aabb_area(node->box);
+        }
+    }
+    bvh->subtree_cost[subtree] = cost;
+}
+
+// Refits the top nodes, they were allocated in pre-order as well
+void bvh_finish(BVH* bvh, bool rebuilt) {
+    val_t cost = 0;
+    for (int i = BVH_TOP_NODES - 1; i >= 0; --i) {
+        BVHNode* node = &bvh->nodes[i];
+        node->box = aabb_union(bvh->nodes[node->left].box, bvh->nodes[node->right].box);
+        cost += aabb_area(node->box);
+    }
+    for (int i = 0; i < CORE_N; ++i) cost += bvh->subtree_cost[i];
+
+    // Normalized by the root, so the whole system expanding doesn't count as degradation
+    val_t root_area = aabb_area(bvh->nodes[bvh->root].box);
+    bvh->cost = root_area > 0 ? cost / root_area : 0;
+
+    if (rebuilt) bvh->built_cost = bvh->cost;
+    bvh->needs_rebuild = bvh->cost > bvh->built_cost * BVH_REBUILD_RATIO;
+}
+
+// Called by every worker with its thread index, refits or rebuilds the tree
+// over the given planets. Returns once the tree is ready to be queried.
+void bvh_update(BVH* bvh, const Planet* planets, int thread_index) {
+    bool rebuild = bvh->needs_rebuild;
+    if (rebuild) {
+        if (thread_index == 0) bvh_partition(bvh, planets);
+        pthread_barrier_wait(&bvh_barrier);
+        bvh_build_subtree(bvh, planets, thread_index);
+    } else {
+        bvh_refit_subtree(bvh, planets, thread_index);
+    }
+
+    pthread_barrier_wait(&bvh_barrier);
+    if (thread_index == 0) bvh_finish(bvh, rebuild);
+    pthread_barrier_wait(&bvh_barrier);
+}
+
+// Appends to out every primitive stored in a leaf overlapping box
+void bvh_query_box(const BVH* bvh, AABB box, Indexes* out) {
+    int stack[BVH_STACK_SIZE];
+    int top = 0;
+    stack[top++] = bvh->root;
+
+    while (top > 0) {
+        const BVHNode* node = &bvh->nodes[stack[--top]];
+        if (!aabb_overlap(node->box, box)) continue;
+
+        if (node->left < 0) {
+            for (int i = node->first; i < node->first + node->count; ++i)
+                da_append(out, (size_t)bvh->indexes[i]);
+        } else {
+            assert(top + 2 <= BVH_STACK_SIZE && "BVH too deep");
+            stack[top++] = node->right;
+            stack[top++] = node->left;
+        }
+    }
+}
+
+// All active bodies whose surface is within r of point, anywhere along their sweep
+void bvh_query_radius(const BVH* bvh, const Planet* planets, Vec3 point, val_t r, Indexes* out) {
+    out->count = 0;
+    bvh_query_box(bvh, aabb_sphere(point, r), out);
+
+    size_t kept = 0;
+    for (size_t i = 0; i < out->count; ++i) {
+        const Planet* planet = &planets[out->items[i]];
+        if (!planet_active(planet)) continue;
+
+        Vec3 center;
+        val_t radious;
+        bvh_planet_sphere(bvh, planet, &center, &radious);
+        Vec3 difference = vec3_sub(center, point);
+        val_t square_distance = difference.x * difference.x
+                              + difference.y * difference.y
+                              + difference.z * difference.z;
+        val_t reach = r + radious;
+        if (square_distance < reach*reach) out->items[kept++] = out->items[i];
+    }
+    out->count = kept;
+}
+
+// All pairs of bodies whose spheres may overlap during the sweep, with first
+// in [from, to). A pair comes up once from each end, so every worker finds
+// the collisions of its own bodies. candidates is scratch space.
+void bvh_overlapping_pairs(const BVH* bvh, const Planet* planets, size_t from, size_t to, Indexes* candidates, IndexPairs* pairs) {
+    pairs->count = 0;
+    for (size_t index = from; index < to; ++index) {
+        if (!planet_active(&planets[index])) continue;
+
+        Vec3 center;
+        val_t radious;
+        bvh_planet_sphere(bvh, &planets[index], &center, &radious);
+        bvh_query_radius(bvh, planets, center, radious, candidates);
+        for (size_t i = 0; i < candidates->count; ++i) {
+            if (candidates->items[i] == index) continue;
+            da_append(pairs, ((IndexPair){.first = index, .second = candidates->items[i]}));
+        }
+    }
+}
+
+// Earliest time in [0, duration] at which two linearly moving spheres touch, -1 if they don't
+val_t sphere_time_of_impact(Vec3 p1, Vec3 v1, val_t r1, Vec3 p2, Vec3 v2, val_t r2, val_t duration) {
+    Vec3 d = vec3_sub(p2, p1);
+    Vec3 v = vec3_sub(v2, v1);
+    val_t radious_sum = r1 + r2;
+
+    val_t c = d.x*d.x + d.y*d.y + d.z*d.z - radious_sum*radious_sum;
+    if (c < 0) return 0; // already overlapping
+
+    val_t b = d.x*v.x + d.y*v.y + d.z*v.z;
+    if (b >= 0) return -1; // moving apart
+
+    val_t a = v.x*v.x + v.y*v.y + v.z*v.z;
+    val_t discriminant = b*b - a*c;
+    if (discriminant < 0) return -1;
+
+    val_t t = (-b - sqrt(discriminant)) / a;
+    return t <= duration ? t : -1;
+}
+
+// Morton order
+//
+// Every MORTON_SORT_INTERVAL steps the bodies are reordered along a Z-curve
+// so neighbours in space are neighbours in memory. The workers run a parallel
+// LSD radix sort on 63 bit codes, inactive bodies sort to the end. Ids and
+// planet_slot keep track of where every body went.
+
+#define MORTON_SORT_INTERVAL 64
+#define MORTON_REPORT_STEPS 8    // steps averaged before and after a sort
+#define MORTON_BITS 21
+
+bool morton_sort = true;
+bool morton_sort_due = false;
+
+uint64_t morton_keys[2][PLANET_COUNT];
+int morton_values[2][PLANET_COUNT];
+int morton_histogram[CORE_N][256];
+AABB morton_bounds[CORE_N];
+PlanetInfo planet_info_sorted[PLANET_COUNT];
+bool morton_skip_pass;
+
+static inline uint64_t morton_spread(uint64_t x) {
+    x &= 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffffull;
+    x = (x | x << 16) & 0x1f0000ff0000ffull;
+    x = (x | x << 8)  & 0x100f00f00f00f00full;
+    x = (x | x << 4)  & 0x10c30c30c30c30c3ull;
+    x = (x | x << 2)  & 0x1249249249249249ull;
+    return x;
+}
+
+static inline uint64_t morton_code(Vec3p position, AABB bounds) {
+    uint64_t code = 0;
+    for (int axis = 0; axis < 3; ++axis) {
+        val_t extent = bounds.max[axis] - bounds.min[axis];
+        val_t t = extent > 0 ? (VEC3_AXIS(position, axis) - bounds.min[axis]) / extent : 0;
+        t = min(max(t, 0), 1);
+        code |= morton_spread((uint64_t)(t * ((1 << MORTON_BITS) - 1))) << axis;
+    }
+    return code;
+}
+
+// Called by every worker with its slice. Reorders ref_planets into
+// working_planets and copies the result back, so both hold the sorted bodies.
+void morton_sort_planets(int thread_index, int from, int to) {
+    AABB bounds = aabb_empty();
+    for (int i = from; i < to; ++i)
+        if (planet_active(&ref_planets[i])) bounds = aabb_union(bounds, aabb_sphere(vec3_unpack(ref_planets[i].position), 0));
+    morton_bounds[thread_index] = bounds;
+    pthread_barrier_wait(&sort_barrier);
+
+    bounds = aabb_empty();
+    for (int k = 0; k < CORE_N; ++k) bounds = aabb_union(bounds, morton_bounds[k]);
+    for (int i = from; i < to; ++i) {
+        morton_keys[0][i] = planet_active(&ref_planets[i]) ? morton_code(ref_planets[i].position, bounds) : UINT64_MAX;
+        morton_values[0][i] = i;
+    }
+
+    int source = 0;
+    for (int shift = 0; shift < 64; shift += 8) {
+        int* histogram = morton_histogram[thread_index];
+        memset(histogram, 0, sizeof(morton_histogram[0]));
+        for (int i = from; i < to; ++i) histogram[(morton_keys[source][i] >> shift) & 0xff] += 1;
+        pthread_barrier_wait(&sort_barrier);
+
+        // Digit major, thread minor, so the scatter is stable
+        if (thread_index == 0) {
+            int offset = 0;
+            morton_skip_pass = false;
+            for (int digit = 0; digit < 256; ++digit) {
+                int digit_start = offset;
+                for (int k = 0; k < CORE_N; ++k) {
+                    int count = morton_histogram[k][digit];
+                    morton_histogram[k][digit] = offset;
+                    offset += count;
+                }
+                if (offset - digit_start == PLANET_COUNT) morton_skip_pass = true;
+            }
+        }
+        pthread_barrier_wait(&sort_barrier);
+        if (morton_skip_pass) continue; // every key has the same digit
+
+        for (int i = from; i < to; ++i) {
+            int destination = histogram[(morton_keys[source][i] >> shift) & 0xff]++;
+            morton_keys[1-source][destination] = morton_keys[source][i];
+            morton_values[1-source][destination] = morton_values[source][i];
+        }
+        pthread_barrier_wait(&sort_barrier);
+        source = 1 - source;
+    }
+
+    for (int i = from; i < to; ++i) {
+        working_planets[i] = ref_planets[morton_values[source][i]];
+        planet_info_sorted[i] = planet_info[morton_values[source][i]];
+        planet_slot[planet_info_sorted[i].id] = i;
+    }
+    pthread_barrier_wait(&sort_barrier);
+
+    memcpy(&ref_planets[from], &working_planets[from], (to - from)*sizeof(Planet));
+    memcpy(&planet_info[from], &planet_info_sorted[from], (to - from)*sizeof(PlanetInfo));
+    if (thread_index == 0) planets_bvh.needs_rebuild = true; // every index changed
+    pthread_barrier_wait(&sort_barrier);
+}
+
+// Per thread hardware counters around the physics phases, to see what the
+// sorting buys. Without perf events (containers, paranoid kernels) only the
+// time is reported.
+
+typedef struct {
+    uint64_t cache_misses;
+    uint64_t nanoseconds;
+    uint64_t interactions; // gravity only
+    uint64_t records;      // gravity only, bodies read by the pulls
+} PhaseCounters;
+
+PhaseCounters thread_counters[CORE_N];
+PhaseCounters gravity_counters[CORE_N];
+bool perf_counting = false;
+
+// Wall time of each phase of a step as worker 0 sees it, waits on the
+// others included. Read by the main thread for --frame-timings.
+typedef enum {
+    PHYSICS_COLLISION,
+    PHYSICS_MERGE,
+    PHYSICS_GRAVITY,
+    PHYSICS_PHASES,
+} PhysicsPhase;
+
+const char* physics_phase_names[PHYSICS_PHASES] = {"collision", "merge", "gravity"};
+atomic_ullong physics_nanoseconds[PHYSICS_PHASES];
+
+// Memory traffic of the gravity pass, summed over the workers
+atomic_ullong gravity_interactions;
+atomic_ullong gravity_bytes;
+
+int perf_cache_misses_open() {
+    struct perf_event_attr attr = {0};
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+PhaseCounters phase_counters_read(int perf_fd) {
+    PhaseCounters counters = {0};
+    if (perf_fd >= 0 && read(perf_fd, &counters.cache_misses, sizeof(counters.cache_misses)) != sizeof(counters.cache_misses))
+        counters.cache_misses = 0;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    counters.nanoseconds = (uint64_t)now.tv_sec*1000000000ull + now.tv_nsec;
+    return counters;
+}
+
+// Bytes the gravity pass brought in from memory. With perf events it's the
+// cache misses times the line size. Without them it's estimated as every
+// record read coming from memory, which ignores the caches so it's an upper
+// bound.
+uint64_t gravity_traffic(PhaseCounters counters) {
+    if (perf_counting) return 64*counters.cache_misses;
+    return sizeof(Planet)*counters.records;
+}
+
+// Called by the main thread once per step, while the workers are past the
+// previous gravity pass
+void morton_report(size_t step) {
+    static PhaseCounters previous;
+    static PhaseCounters window[MORTON_REPORT_STEPS];
+    static PhaseCounters before;
+
+    PhaseCounters total = {0};
+    for (int k = 0; k < CORE_N; ++k) {
+        total.cache_misses += thread_counters[k].cache_misses;
+        total.nanoseconds += thread_counters[k].nanoseconds;
+    }
+    window[step % MORTON_REPORT_STEPS] = (PhaseCounters){
+        .cache_misses = total.cache_misses - previous.cache_misses,
+        .nanoseconds = total.nanoseconds - previous.nanoseconds,
+    };
+    previous = total;
+
+    size_t phase = step % MORTON_SORT_INTERVAL;
+    if (phase != MORTON_REPORT_STEPS && phase != 2*MORTON_REPORT_STEPS) return;
+
+    PhaseCounters sum = {0};
+    for (int i = 0; i < MORTON_REPORT_STEPS; ++i) {
+        sum.cache_misses += window[i].cache_misses;
+        sum.nanoseconds += window[i].nanoseconds;
+    }
+    if (phase == MORTON_REPORT_STEPS) {
+        before = sum;
+        return;
+    }
+
+    double steps = MORTON_REPORT_STEPS * CORE_N; // time is summed over threads
+    printf("Morton sort: %.2f -> %.2f ms per step", before.nanoseconds/steps/1e6, sum.nanoseconds/steps/1e6);
+    if (before.cache_misses > 0) {
+        printf(", %.0f -> %.0f cache misses per step (%+.1f%%)",
+               before.cache_misses/(double)MORTON_REPORT_STEPS, sum.cache_misses/(double)MORTON_REPORT_STEPS,
+               100.0*((double)sum.cache_misses - before.cache_misses)/before.cache_misses);
+    }
+    printf("\n");
+}
+
+// Conservation diagnostics, accumulated by every worker during the gravity
+// pass and reduced by the main thread once the step is over.
+//
+// Merges are inelastic and drop the pair's orbital angular momentum, so the
+// energy and angular momentum baselines restart whenever a body disappears.
+
+#define ENERGY_DRIFT_ALARM 1e-2
+#define MOMENTUM_DRIFT_ALARM 1e-4            // relative to sum(m|v|)
+#define ANGULAR_MOMENTUM_DRIFT_ALARM 1e-3    // relative to sum(|r x mv|)
+
+typedef struct {
+    double kinetic;
+    double potential;
+    double momentum[3];
+    double angular_momentum[3];
+    double momentum_scale;
+    double angular_momentum_scale;
+    int active;
+    int merges; // in the step, tells the ranks their PlanetInfo changed
+} Diagnostics;
+
+Diagnostics thread_diagnostics[CORE_N];
+Diagnostics diagnostics;
+Diagnostics diagnostics_baseline;
+size_t diagnostics_step;
+bool print_diagnostics = false;
+
+static inline double diagnostics_energy(Diagnostics d) {
+    return d.kinetic + d.potential;
+}
+
+static inline double vec3d_length(const double v[3]) {
+    return sqrt(v[0]*v[0] + v[1]*v[1] + v[2]*v[2]);
+}
+
+// The potential is added by the caller, it comes out of the force loop
+void diagnostics_add_body(Diagnostics* d, const Planet* planet) {
+    double m = planet->mass;
+    Vec3p r = planet->position;
+    Vec3p v = planet->velocity;
+    double p[3] = {m*v.x, m*v.y, m*v.z};
+    double l[3] = {r.y*p[2] - r.z*p[1], r.z*p[0] - r.x*p[2], r.x*p[1] - r.y*p[0]};
+
+    d->kinetic += 0.5 * m * (v.x*v.x + v.y*v.y + v.z*v.z);
+    for (int axis = 0; axis < 3; ++axis) {
+        d->momentum[axis] += p[axis];
+        d->angular_momentum[axis] += l[axis];
+    }
+    d->momentum_scale += vec3d_length(p);
+    d->angular_momentum_scale += vec3d_length(l);
+    d->active += 1;
+}
+
+void diagnostics_add(Diagnostics* total, Diagnostics d) {
+    total->kinetic += d.kinetic;
+    total->potential += d.potential;
+    for (int axis = 0; axis < 3; ++axis) {
+        total->momentum[axis] += d.momentum[axis];
+        total->angular_momentum[axis] += d.angular_momentum[axis];
+    }
+    total->momentum_scale += d.momentum_scale;
+    total->angular_momentum_scale += d.angular_momentum_scale;
+    total->active += d.active;
+    total->merges += d.merges;
+}
+
+Diagnostics diagnostics_reduce() {
+    Diagnostics total = {0};
+    for (int i = 0; i < CORE_N; ++i) diagnostics_add(&total, thread_diagnostics[i]);
+    return total;
+}
+
+// Relative drifts against the baseline: energy, momentum, angular momentum
+void diagnostics_drift(Diagnostics d, Diagnostics baseline, double drift[3]) {
+    double momentum_delta[3], angular_delta[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        momentum_delta[axis] = d.momentum[axis] - baseline.momentum[axis];
+        angular_delta[axis] = d.angular_momentum[axis] - baseline.angular_momentum[axis];
+    }
+    drift[0] = fabs(diagnostics_energy(d) - diagnostics_energy(baseline)) / max(fabs(diagnostics_energy(baseline)), EPS);
+    drift[1] = vec3d_length(momentum_delta) / max(baseline.momentum_scale, EPS);
+    drift[2] = vec3d_length(angular_delta) / max(baseline.angular_momentum_scale, EPS);
+}
+
+// Called by the main thread once per step with the reduced totals
+void diagnostics_update(Diagnostics total) {
+    diagnostics = total;
+    diagnostics_step += 1;
+
+    if (diagnostics_step == 1) {
+        diagnostics_baseline = diagnostics;
+    } else if (diagnostics.active != diagnostics_baseline.active) {
+        // Momentum survives merges, the rest doesn't
+        Diagnostics rebased = diagnostics;
+        memcpy(rebased.momentum, diagnostics_baseline.momentum, sizeof(rebased.momentum));
+        rebased.momentum_scale = diagnostics_baseline.momentum_scale;
+        diagnostics_baseline = rebased;
+    }
+
+    double drift[3];
+    diagnostics_drift(diagnostics, diagnostics_baseline, drift);
+
+    if (print_diagnostics) {
+        printf("step %zu: E = %e (K %e, U %e), |P| = %e, |L| = %e, active %d\n",
+               diagnostics_step, diagnostics_energy(diagnostics), diagnostics.kinetic, diagnostics.potential,
+               vec3d_length(diagnostics.momentum), vec3d_length(diagnostics.angular_momentum), diagnostics.active);
+    }
+
+    static bool alarm[3] = {0};
+    const double limits[3] = {ENERGY_DRIFT_ALARM, MOMENTUM_DRIFT_ALARM, ANGULAR_MOMENTUM_DRIFT_ALARM};
+    const char* names[3] = {"energy", "momentum", "angular momentum"};
+    for (int i = 0; i < 3; ++i) {
+        bool over = drift[i] > limits[i];
+        if (over && !alarm[i]) fprintf(stderr, "WARNING: step %zu: %s drift %e exceeds %e\n", diagnostics_step, names[i], drift[i], limits[i]);
+        alarm[i] = over;
+    }
+}
+
+// Physics kernels, compiled once per instruction set. compile_run.sh builds
+// for baseline x86-64 so the binary runs anywhere, at startup the widest
+// variant the CPU supports is picked.
+
+typedef enum {
+    KERNELS_BASELINE,
+    KERNELS_SSE42,
+    KERNELS_AVX2,
+    KERNELS_AVX512,
+    KERNELS_COUNT
+} Kernels;
+
+static_assert(KERNELS_COUNT == 4 && "Kernels count changed, add its name and variants");
+
+char* kernels_names[KERNELS_COUNT] = {
+    [KERNELS_BASELINE] = "baseline",
+    [KERNELS_SSE42   ] = "sse4.2",
+    [KERNELS_AVX2    ] = "avx2",
+    [KERNELS_AVX512  ] = "avx512",
+};
+
+// Pull of the other bodies in others[from, to) on planet, the force still
+// has to be divided by PLANET_COUNT. The potential is summed the same way for
+// the diagnostics. Returns how many bodies pulled.
+//
+// The body is spelled out in every variant, GCC applies the variant's
+// optimize flags to its own code but not to an inlined helper. The sums only
+// vectorize if they may be reordered, and sqrt only without errno (see
+// compile_run.sh). The baseline keeps the exact order and is what --regress
+// compares the others to.
+#define GRAVITY_VARIANT(name, ...)                                                                                    \
+    __attribute__((__VA_ARGS__))                                                                                     \
+    int gravity_sum_##name(const Planet* planet, size_t index, const Planet* others, size_t from, size_t to,       \
+                           Vec3* force, val_t* potential) {                                                          \
+        val_t force_x = 0, force_y = 0, force_z = 0;                                                                 \
+        val_t total_potential = 0;                                                                                   \
+        int interactions = 0;                                                                                        \
+                                                                                                                     \
+        for (size_t other_index = from; other_index < to; ++other_index) {                                           \
+            const Planet* other_planet = &others[other_index];                                                       \
+                                                                                                                     \
+            /* Selects instead of branches, skipped bodies add zeros */                                              \
+            bool pulls = (other_index != index) & (other_planet->mass > 0);                                          \
+                                                                                                                     \
+            val_t dx = other_planet->position.x - planet->position.x;                                                \
+            val_t dy = other_planet->position.y - planet->position.y;                                                \
+            val_t dz = other_planet->position.z - planet->position.z;                                                \
+                                                                                                                     \
+            val_t square_distance = pulls ? dx*dx + dy*dy + dz*dz : 1;                                               \
+                                                                                                                     \
+            val_t distance = sqrt(square_distance);                                                                  \
+            val_t magnitude = G * (planet->mass * other_planet->mass) / square_distance * pulls;                     \
+                                                                                                                     \
+            force_x += magnitude * (dx / distance);                                                                  \
+            force_y += magnitude * (dy / distance);                                                                  \
+            force_z += magnitude * (dz / distance);                                                                  \
+            total_potential += magnitude * distance;                                                                 \
+            interactions += pulls;                                                                                   \
+        }                                                                                                            \
+                                                                                                                     \
+        *force = vec3(force_x, force_y, force_z);                                                                    \
+        *potential = total_potential;                                                                                \
+        return interactions;                                                                                         \
+    }
+
+#define GRAVITY_REORDER optimize("associative-math", "no-signed-zeros", "no-trapping-math")
+
+GRAVITY_VARIANT(baseline, target("arch=x86-64"))
+GRAVITY_VARIANT(sse42,    target("sse4.2"), GRAVITY_REORDER)
+GRAVITY_VARIANT(avx2,     target("avx2,fma"), GRAVITY_REORDER)
+GRAVITY_VARIANT(avx512,   target("avx512f,avx512vl,avx512dq,avx2,fma"), GRAVITY_REORDER)
+
+typedef int (*GravityKernel)(const Planet* planet, size_t index, const Planet* others, size_t from, size_t to,
+                             Vec3* force, val_t* potential);
+
+GravityKernel gravity_kernels[KERNELS_COUNT] = {
+    [KERNELS_BASELINE] = gravity_sum_baseline,
+    [KERNELS_SSE42   ] = gravity_sum_sse42,
+    [KERNELS_AVX2    ] = gravity_sum_avx2,
+    [KERNELS_AVX512  ] = gravity_sum_avx512,
+};
+
+Kernels kernels = KERNELS_BASELINE;
+GravityKernel gravity_kernel = gravity_sum_baseline;
+
+bool kernels_supported(Kernels variant) {
+    __builtin_cpu_init();
+    switch (variant) {
+        case KERNELS_BASELINE: return true;
+        case KERNELS_SSE42:    return __builtin_cpu_supports("sse4.2");
+        case KERNELS_AVX2:     return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+        case KERNELS_AVX512:   return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl")
+                                   && __builtin_cpu_supports("avx512dq") && kernels_supported(KERNELS_AVX2);
+        default: return false;
+    }
+}
+
+// The widest supported variant unless one was asked for
+void kernels_select(Kernels requested) {
+    kernels = requested;
+    if (requested == KERNELS_COUNT) {
+        kernels = KERNELS_BASELINE;
+        for (int k = 0; k < KERNELS_COUNT; ++k) if (kernels_supported(k)) kernels = k;
+    }
+    gravity_kernel = gravity_kernels[kernels];
+    printf("Kernels: %s\n", kernels_names[kernels]);
+}
+
+// Merges found in the collision pass. The colors are blended after it, in a
+// fixed order, a body can be absorbed while it absorbs another one.
+typedef struct {
+    int absorber;
+    int absorbed;
+    val_t weight; // of the absorber
+} Merge;
+
+typedef struct {
+    size_t count;
+    size_t capacity;
+    Merge* items;
+} Merges;
+
+Merges thread_merges[CORE_N];
+int step_merges; // by this rank, counted by worker 0 before gravity
+Vec3 gravity_forces[PLANET_COUNT]; // summed over the blocks of the ring
+
+// Returns how many merges there were
+int merges_apply() {
+    int merges = 0;
+    for (int k = 0; k < CORE_N; ++k) {
+        merges += thread_merges[k].count;
+        for (size_t i = 0; i < thread_merges[k].count; ++i) {
+            Merge merge = thread_merges[k].items[i];
+            PlanetInfo* info = &planet_info[merge.absorber];
+            vec3_mult_by_s(&info->color, merge.weight);
+            vec3_add_to(&info->color, vec3_mult_s(planet_info[merge.absorbed].color, 1 - merge.weight));
+            vec3_mult_by_s(&info->color, 1/vec3_max(info->color));
+            info->merges += 1;
+        }
+        thread_merges[k].count = 0;
+    }
+    return merges;
+}
+
+void step_begin(size_t step);
+void exchange_planets(Planet* planets);
+int gravity_passes();
+void gravity_block(int pass, int* from, int* to);
+void gravity_ring_pass(Planet* planets, int pass);
+
+// Adds the time since start to a phase, returns the end
+static inline uint64_t physics_phase_end(PhysicsPhase phase, uint64_t start) {
+    uint64_t now = phase_counters_read(-1).nanoseconds;
+    atomic_fetch_add_explicit(&physics_nanoseconds[phase], now - start, memory_order_relaxed);
+    return now;
+}
+
+void* planets_thread(void* arg) {
+    PlanetsThreadData data = *(PlanetsThreadData*)arg;
+    printf("Processing from %d to %d\n", data.from, data.to);
+    Indexes candidates = {0};
+    IndexPairs pairs = {0};
+
+    init_planets(data.from, data.to);
+    pthread_barrier_wait(&init_barrier);
+
+    int perf_fd = perf_cache_misses_open();
+    if (perf_fd >= 0) perf_counting = true;
+    bool leader = data.thread_index == 0;
+
+    while(true) {
+        pthread_barrier_wait(&start_collision_barrier);
+        struct timespec batch_start;
+        clock_gettime(CLOCK_MONOTONIC, &batch_start);
+        uint64_t leader_time = 0;
+
+        for (int k = 0; k < batch_steps; ++k) {
+            // The main thread set up the first step, worker 0 does the others
+            if (k > 0) {
+                pthread_barrier_wait(&step_barrier);
+                if (leader) {
+                    physics_phase_end(PHYSICS_GRAVITY, leader_time);
+                    step_begin(batch_first_step + k);
+                }
+                pthread_barrier_wait(&step_barrier);
+            }
+
+            // Collisions
+            if (morton_sort_due) morton_sort_planets(data.thread_index, data.from, data.to);
+            if (k == 0) {
+                render_snapshot(data.thread_index);
+                pthread_barrier_wait(&published_barrier);
+            }
+
+            PhaseCounters phase_start = phase_counters_read(perf_fd);
+            leader_time = phase_start.nanoseconds;
+            memcpy(&working_planets[data.from], &ref_planets[data.from], (data.to - data.from)*sizeof(Planet));
+            bvh_update(&planets_bvh, ref_planets, data.thread_index);
+
+            bvh_overlapping_pairs(&planets_bvh, ref_planets, data.from, data.to, &candidates, &pairs);
+            for (size_t p = 0; p < pairs.count; ++p) {
+                size_t index = pairs.items[p].first;
+                size_t other_index = pairs.items[p].second;
+                Planet* planet = &working_planets[index];
+                Planet* other_planet = &ref_planets[other_index];
+
+                // Gone to an earlier pair, merging again would bring it back with no mass
+                if (!planet_active(planet)) continue;
+
+                // Swept test over the coming step so fast bodies can't tunnel through each other.
+                // Both ends test the snapshot, so they always agree on whether they merged.
+                Planet* ref_planet = &ref_planets[index];
+                val_t time_of_impact = sphere_time_of_impact(vec3_unpack(ref_planet->position),   vec3_unpack(ref_planet->velocity),   ref_planet->radious,
+                                                             vec3_unpack(other_planet->position), vec3_unpack(other_planet->velocity), other_planet->radious,
+                                                             planets_bvh.sweep);
+
+                bool planets_collided = time_of_impact >= 0;
+                //if (planets_collided) printf("collided\n");
+                //if (!planets_collided) printf("didn't collide\n");
+                if (planets_collided) {
+                    val_t wsum = planet->mass + other_planet->mass;
+                    val_t weight1 = planet->mass / wsum;
+                    val_t weight2 = other_planet->mass / wsum;
+
+                    if (planet_info[index].id > planet_info[other_index].id) {
+                        planet->mass = 0;
+                        planet_info[index].merged_into = planet_info[other_index].id;
+                    } else {
+
+                        planet->mass += other_planet->mass;
+
+                        da_append(&thread_merges[data.thread_index], ((Merge){.absorber = index, .absorbed = other_index, .weight = weight1}));
+
+                        // Merging at the center of mass now is the same as merging at the
+                        // time of impact, momentum is conserved so it moves linearly.
+                        planet->position.x = planet->position.x*weight1 + other_planet->position.x*weight2;
+                        planet->position.y = planet->position.y*weight1 + other_planet->position.y*weight2;
+                        planet->position.z = planet->position.z*weight1 + other_planet->position.z*weight2;
+
+                        planet->velocity.x = planet->velocity.x*weight1 + other_planet->velocity.x*weight2;
+                        planet->velocity.y = planet->velocity.y*weight1 + other_planet->velocity.y*weight2;
+                        planet->velocity.z = planet->velocity.z*weight1 + other_planet->velocity.z*weight2;
+
+                        planet->radious = max(planet->radious, other_planet->radious);
+                    }
+                }
+            }
+
+            //printf("waiting on collisions, thread from %d to %d\n", data.from, data.to);
+            pthread_barrier_wait(&collision_barrier);
+            //printf("beggining loop, thread from %d to %d\n", data.from, data.to);
+            if (leader) {
+                leader_time = physics_phase_end(PHYSICS_COLLISION, leader_time);
+                swap_planet_buffers();
+                step_merges = merges_apply();
+            }
+            pthread_barrier_wait(&updated_ref_barrier);
+            if (leader) leader_time = physics_phase_end(PHYSICS_MERGE, leader_time);
+            // Gravity
+            //
+            // One pass per rank. Every worker sums the pull of the block its
+            // rank holds while worker 0 sends that block on and receives the
+            // next one into its place, nobody reads it before the next pass.
+            memcpy(&working_planets[data.from], &ref_planets[data.from], (data.to - data.from)*sizeof(Planet));
+            PhaseCounters gravity_start = phase_counters_read(perf_fd);
+            uint64_t interactions = 0;
+            uint64_t records = 0;
+            Diagnostics step_diagnostics = {0};
+            if (leader) step_diagnostics.merges = step_merges;
+            int passes = gravity_passes();
+            for (int pass = 0; pass < passes; ++pass) {
+                if (leader && pass < passes-1) gravity_ring_pass(ref_planets, pass);
+
+                int block_from, block_to;
+                gravity_block(pass, &block_from, &block_to);
+                for (size_t index = data.from; index < data.to; ++index) {
+                    if (!planet_active(&working_planets[index])) continue;
+
+                    Vec3 force;
+                    val_t potential;
+                    interactions += gravity_kernel(&working_planets[index], index, ref_planets, block_from, block_to, &force, &potential);
+                    records += block_to - block_from;
+                    gravity_forces[index] = pass == 0 ? force : vec3_add(gravity_forces[index], force);
+
+                    // Every pair is seen from both ends
+                    step_diagnostics.potential -= 0.5 * potential / PLANET_COUNT;
+                }
+                if (pass < passes-1) pthread_barrier_wait(&gravity_barrier);
+            }
+
+            for (size_t index = data.from; index < data.to; ++index) {
+                if (!planet_active(&working_planets[index])) continue;
+                Planet* planet = &working_planets[index];
+
+                Vec3 total_force = gravity_forces[index];
+                vec3_div_by_s(&total_force, PLANET_COUNT);
+                diagnostics_add_body(&step_diagnostics, planet);
+
+                Vec3 acceleration = vec3_div_s(total_force, planet->mass);
+                vec3_mult_by_s(&acceleration, (val_t)dt);
+                planet->velocity.x += acceleration.x;
+                planet->velocity.y += acceleration.y;
+                planet->velocity.z += acceleration.z;
+                planet->position.x += planet->velocity.x*(val_t)dt;
+                planet->position.y += planet->velocity.y*(val_t)dt;
+                planet->position.z += planet->velocity.z*(val_t)dt;
+            }
+            thread_diagnostics[data.thread_index] = step_diagnostics;
+
+            PhaseCounters phase_end = phase_counters_read(perf_fd);
+            thread_counters[data.thread_index].cache_misses += phase_end.cache_misses - phase_start.cache_misses;
+            thread_counters[data.thread_index].nanoseconds += phase_end.nanoseconds - phase_start.nanoseconds;
+            gravity_counters[data.thread_index].cache_misses += phase_end.cache_misses - gravity_start.cache_misses;
+            gravity_counters[data.thread_index].nanoseconds += phase_end.nanoseconds - gravity_start.nanoseconds;
+            gravity_counters[data.thread_index].interactions += interactions;
+            gravity_counters[data.thread_index].records += records;
+            PhaseCounters step_gravity = {.cache_misses = phase_end.cache_misses - gravity_start.cache_misses, .records = records};
+            atomic_fetch_add_explicit(&gravity_interactions, interactions, memory_order_relaxed);
+            atomic_fetch_add_explicit(&gravity_bytes, gravity_traffic(step_gravity), memory_order_relaxed);
+        }
+        // The gravity of the other steps ends at the next step's barrier,
+        // the last one at worker 0's own slice
+        if (leader) physics_phase_end(PHYSICS_GRAVITY, leader_time);
+
+        if (leader) {
+            struct timespec batch_end;
+            clock_gettime(CLOCK_MONOTONIC, &batch_end);
+            batch_seconds = (batch_end.tv_sec - batch_start.tv_sec) + (batch_end.tv_nsec - batch_start.tv_nsec)*1e-9;
+        }
+        //printf("finished gravity, waiting on barrier, thread from %d to %d\n", data.from, data.to);
+        pthread_barrier_wait(&end_barrier);
+        //printf("ending loop, thread from %d to %d \n", data.from, data.to);
+    }
+    return NULL;
+}
+
+pthread_t threads[CORE_N];
+
+// Multi-process mode
+//
+// K processes each own an index slice of the bodies. Collisions need the
+// whole snapshot, so a step starts with an allgather around a ring: each rank
+// passes on the slice it got last, and after K-1 passes everyone has it in
+// ref_planets. Gravity goes around the same ring block by block and works on
+// the block it holds while the next one is in flight, so no gather is needed
+// after the collisions. PlanetInfo only changes on merges and is only
+// gathered then. Ranks talk through a Transport, so the shared memory ring
+// below can be swapped for sockets without touching the rest.
+
+typedef struct Transport Transport;
+struct Transport {
+    int rank;
+    int size;
+    // Sends to rank+1 and receives from rank-1, both block until done
+    void (*send)(Transport* transport, const void* data, size_t bytes);
+    void (*recv)(Transport* transport, void* data, size_t bytes);
+    void (*close)(Transport* transport);
+    void* impl;
+};
+
+Transport* transport = NULL;
+int rank_from = 0;
+int rank_to = PLANET_COUNT;
+
+// Same split as the threads, the last part takes the remainder
+void slice_bounds(int count, int parts, int part, int* from, int* to) {
+    int step = count/parts;
+    *from = part*step;
+    *to = part == parts-1 ? count : *from + step;
+}
+
+// Every rank contributes the bytes [offsets[rank], offsets[rank+1]) of data
+void ring_allgather(Transport* transport, void* data, const size_t* offsets) {
+    int k = transport->size;
+    for (int pass = 0; pass < k-1; ++pass) {
+        int send_block = ((transport->rank - pass) % k + k) % k;
+        int recv_block = ((transport->rank - pass - 1) % k + k) % k;
+        transport->send(transport, (char*)data + offsets[send_block], offsets[send_block+1] - offsets[send_block]);
+        transport->recv(transport, (char*)data + offsets[recv_block], offsets[recv_block+1] - offsets[recv_block]);
+    }
+}
+
+// Every rank contributes its slice of a per body array
+void exchange_slices(void* records, size_t record_size) {
+    if (transport == NULL) return;
+    size_t offsets[transport->size + 1];
+    for (int r = 0; r < transport->size; ++r) {
+        int from, to;
+        slice_bounds(PLANET_COUNT, transport->size, r, &from, &to);
+        offsets[r] = from*record_size;
+    }
+    offsets[transport->size] = PLANET_COUNT*record_size;
+    ring_allgather(transport, records, offsets);
+}
+
+void exchange_planets(Planet* planets) {
+    exchange_slices(planets, sizeof(Planet));
+}
+
+// Rank 0 draws everyone's colors, and merges across ranks blend them
+void exchange_planet_info() {
+    exchange_slices(planet_info, sizeof(PlanetInfo));
+}
+
+int gravity_passes() {
+    return transport == NULL ? 1 : transport->size;
+}
+
+// The bodies a rank sums the pull of in a pass, its own slice first and then
+// the one of the rank before it, like the allgather
+void gravity_block(int pass, int* from, int* to) {
+    if (transport == NULL) {
+        *from = 0;
+        *to = PLANET_COUNT;
+        return;
+    }
+    int k = transport->size;
+    slice_bounds(PLANET_COUNT, k, ((transport->rank - pass) % k + k) % k, from, to);
+}
+
+// Sends the block of this pass on and receives the one of the next pass
+void gravity_ring_pass(Planet* planets, int pass) {
+    int from, to;
+    gravity_block(pass, &from, &to);
+    transport->send(transport, &planets[from], (to - from)*sizeof(Planet));
+    gravity_block(pass + 1, &from, &to);
+    transport->recv(transport, &planets[from], (to - from)*sizeof(Planet));
+}
+
+// Gathers one fixed size record per rank
+void exchange_records(void* records, size_t record_size) {
+    if (transport == NULL) return;
+    size_t offsets[transport->size + 1];
+    for (int r = 0; r <= transport->size; ++r) offsets[r] = r*record_size;
+    ring_allgather(transport, records, offsets);
+}
+
+// POSIX shared memory ring: one single slot channel per rank, written only by
+// that rank and read only by the next one
+
+#define SHM_MAGIC 0x53594d43 // "SYMC"
+#define SHM_ALIGN 64
+
+typedef struct {
+    atomic_uint sent;
+    atomic_uint received;
+    size_t bytes;
+} ShmChannel;
+
+typedef struct {
+    atomic_uint magic;
+    atomic_uint shutdown;
+    uint32_t size;
+    uint32_t channel_stride;
+} ShmHeader;
+
+typedef struct {
+    char name[64];
+    ShmHeader* header;
+    size_t mapped;
+} ShmRing;
+
+#define shm_align(bytes) (((bytes) + SHM_ALIGN-1) / SHM_ALIGN * SHM_ALIGN)
+
+static inline ShmChannel* shm_channel(ShmRing* ring, int rank) {
+    return (ShmChannel*)((char*)ring->header + shm_align(sizeof(ShmHeader)) + (size_t)rank*ring->header->channel_stride);
+}
+
+static inline void shm_wait(ShmRing* ring) {
+    // The owner of the segment is gone, nobody is going to answer
+    if (atomic_load_explicit(&ring->header->shutdown, memory_order_relaxed)) exit(0);
+    sched_yield();
+}
+
+void shm_send(Transport* transport, const void* data, size_t bytes) {
+    ShmRing* ring = transport->impl;
+    ShmChannel* channel = shm_channel(ring, transport->rank);
+    assert(bytes <= ring->header->channel_stride - shm_align(sizeof(ShmChannel)) && "message larger than the channel");
+
+    unsigned sent = atomic_load_explicit(&channel->sent, memory_order_relaxed);
+    while (atomic_load_explicit(&channel->received, memory_order_acquire) != sent) shm_wait(ring);
+
+    memcpy((char*)channel + shm_align(sizeof(ShmChannel)), data, bytes);
+    channel->bytes = bytes;
+    atomic_store_explicit(&channel->sent, sent + 1, memory_order_release);
+}
+
+void shm_recv(Transport* transport, void* data, size_t bytes) {
+    ShmRing* ring = transport->impl;
+    ShmChannel* channel = shm_channel(ring, (transport->rank - 1 + transport->size) % transport->size);
+
+    unsigned received = atomic_load_explicit(&channel->received, memory_order_relaxed);
+    while (atomic_load_explicit(&channel->sent, memory_order_acquire) == received) shm_wait(ring);
+
+    assert(channel->bytes == bytes && "ranks disagree on the message size");
+    memcpy(data, (char*)channel + shm_align(sizeof(ShmChannel)), bytes);
+    atomic_store_explicit(&channel->received, received + 1, memory_order_release);
+}
+
+void shm_close(Transport* transport) {
+    ShmRing* ring = transport->impl;
+    if (transport->rank == 0) {
+        atomic_store(&ring->header->shutdown, 1);
+        shm_unlink(ring->name);
+    }
+    munmap(ring->header, ring->mapped);
+    free(ring);
+    free(transport);
+}
+
+// Rank 0 creates the segment, the rest wait for it to show up
+Transport* shm_transport_open(const char* name, int rank, int size, size_t max_message) {
+    ShmRing* ring = calloc(1, sizeof(ShmRing));
+    snprintf(ring->name, sizeof(ring->name), "%s", name);
+
+    size_t stride = shm_align(sizeof(ShmChannel)) + shm_align(max_message);
+    ring->mapped = shm_align(sizeof(ShmHeader)) + stride*size;
+
+    int fd;
+    if (rank == 0) {
+        shm_unlink(name); // leftover from a crashed run
+        fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0 || ftruncate(fd, ring->mapped) != 0) {
+            perror("Failed to create shared memory");
+            exit(1);
+        }
+    } else {
+        struct stat st;
+        while ((fd = shm_open(name, O_RDWR, 0600)) < 0) usleep(1000);
+        while (fstat(fd, &st) == 0 && (size_t)st.st_size < ring->mapped) usleep(1000);
+    }
+
+    ring->header = mmap(NULL, ring->mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring->header == MAP_FAILED) {
+        perror("Failed to map shared memory");
+        exit(1);
+    }
+
+    if (rank == 0) {
+        ring->header->size = size;
+        ring->header->channel_stride = stride;
+        atomic_store(&ring->header->magic, SHM_MAGIC);
+    } else {
+        while (atomic_load(&ring->header->magic) != SHM_MAGIC) usleep(1000);
+        if (ring->header->size != (uint32_t)size) {
+            fprintf(stderr, "Shared memory %s is set up for %u processes, not %d\n", name, ring->header->size, size);
+            exit(1);
+        }
+    }
+
+    Transport* transport = malloc(sizeof(Transport));
+    *transport = (Transport){
+        .rank = rank,
+        .size = size,
+        .send = shm_send,
+        .recv = shm_recv,
+        .close = shm_close,
+        .impl = ring,
+    };
+    return transport;
+}
+
+// Every rank steps with rank 0's dt
+void exchange_dt() {
+    if (transport == NULL) return;
+    val_t dts[transport->size];
+    dts[transport->rank] = dt;
+    exchange_records(dts, sizeof(val_t));
+    dt = dts[0];
+}
+
+// Sums the per rank totals
+Diagnostics exchange_diagnostics(Diagnostics local) {
+    if (transport == NULL) return local;
+    Diagnostics ranks[transport->size];
+    ranks[transport->rank] = local;
+    exchange_records(ranks, sizeof(Diagnostics));
+
+    Diagnostics total = {0};
+    for (int r = 0; r < transport->size; ++r) diagnostics_add(&total, ranks[r]);
+    return total;
+}
+
+// Serial work between two steps, once every worker is done with the last
+// one. The main thread does it before a batch, worker 0 inside one.
+void step_begin(size_t step) {
+    if (step > 0) {
+        diagnostics_update(exchange_diagnostics(diagnostics_reduce()));
+        if (morton_sort) morton_report(step);
+    }
+
+    exchange_dt();
+    swap_planet_buffers();
+    exchange_planets(ref_planets);
+    if (step == 0 || diagnostics.merges > 0) exchange_planet_info();
+    planets_bvh.sweep = dt;
+    morton_sort_due = morton_sort && step % MORTON_SORT_INTERVAL == MORTON_REPORT_STEPS;
+}
+
+// Every rank runs batches as long as rank 0's
+void exchange_batch_steps() {
+    if (transport == NULL) return;
+    int counts[transport->size];
+    counts[transport->rank] = batch_steps;
+    exchange_records(counts, sizeof(int));
+    batch_steps = counts[0];
+}
+
+// Main thread's side of a batch of steps. Returns the number of steps once
+// the state they start from is published in render_bodies, the workers keep
+// going after that and the next call waits for them.
+int simulation_steps(size_t first_step, int count) {
+    if (first_step > 0) {
+        pthread_barrier_wait(&end_barrier);
+        step_seconds = batch_seconds / batch_steps;
+    }
+
+    batch_steps = count;
+    exchange_batch_steps();
+    batch_first_step = first_step;
+    step_begin(first_step);
+    render_published = 1 - render_published;
+    render_first = first_step == 0;
+    pthread_barrier_wait(&start_collision_barrier);
+
+    //puts("Handling collisions");
+    pthread_barrier_wait(&published_barrier);
+    return batch_steps;
+}
+
+// Waits for the batch the last simulation_steps call left running. The
+// workers are idle afterwards, and nothing touches the transport.
+void simulation_finish() {
+    pthread_barrier_wait(&end_barrier);
+}
+
+// Regression table: every kernel variant, with and without sorting, runs the
+// same bodies from the same seed. The first row is the reference the others
+// are compared to for merges and final positions, accelerations are compared
+// to a direct sum in double precision.
+
+typedef struct {
+    char name[32];
+    double acceleration_rms;      // relative error
+    double acceleration_max;
+    double energy_drift;
+    int merges;
+    int merge_mismatches;         // bodies merged in one run but not the other
+    double position_rms;          // against the reference run
+    double seconds_per_step;
+    double bytes_per_interaction; // in the gravity pass, estimated without perf events
+} RegressRow;
+
+Planet regress_reference[PLANET_COUNT]; // by id
+
+void gravity_reference(Planet* planets, size_t index, double force[3]) {
+    force[0] = force[1] = force[2] = 0;
+    Planet* planet = &planets[index];
+    for (size_t other_index = 0; other_index < PLANET_COUNT; ++other_index) {
+        Planet* other_planet = &planets[other_index];
+        if (other_index == index || !planet_active(other_planet)) continue;
+
+        double difference[3] = {
+            (double)other_planet->position.x - planet->position.x,
+            (double)other_planet->position.y - planet->position.y,
+            (double)other_planet->position.z - planet->position.z,
+        };
+        double distance = vec3d_length(difference);
+        double magnitude = G * ((double)planet->mass * other_planet->mass) / (distance*distance);
+        for (int axis = 0; axis < 3; ++axis) force[axis] += magnitude * difference[axis] / distance;
+    }
+}
+
+// Runs with whatever kernels and sorting are set, the workers must be idle
+RegressRow regress_run(int steps, bool reference) {
+    RegressRow row = {0};
+    snprintf(row.name, sizeof(row.name), "%s%s", kernels_names[kernels], morton_sort ? " sorted" : "");
+
+    init_planets(0, PLANET_COUNT);
+    planets_bvh.needs_rebuild = true;
+    diagnostics_step = 0;
+
+    // The force per mass is the same relative error as the acceleration
+    double square_sum = 0;
+    for (size_t index = 0; index < PLANET_COUNT; ++index) {
+        double expected[3];
+        gravity_reference(working_planets, index, expected);
+        Vec3 force;
+        val_t potential;
+        gravity_kernel(&working_planets[index], index, working_planets, 0, PLANET_COUNT, &force, &potential);
+
+        double error[3] = {force.x - expected[0], force.y - expected[1], force.z - expected[2]};
+        double relative = vec3d_length(error) / max(vec3d_length(expected), EPS);
+        square_sum += relative*relative;
+        row.acceleration_max = max(row.acceleration_max, relative);
+    }
+    row.acceleration_rms = sqrt(square_sum / PLANET_COUNT);
+
+    memset(gravity_counters, 0, sizeof(gravity_counters));
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    simulation_steps(0, steps);
+    simulation_finish();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    row.seconds_per_step = ((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)*1e-9) / steps;
+
+    PhaseCounters gravity = {0};
+    for (int k = 0; k < CORE_N; ++k) {
+        gravity.cache_misses += gravity_counters[k].cache_misses;
+        gravity.interactions += gravity_counters[k].interactions;
+        gravity.records += gravity_counters[k].records;
+    }
+    if (gravity.interactions > 0) row.bytes_per_interaction = (double)gravity_traffic(gravity) / gravity.interactions;
+
+    diagnostics_update(diagnostics_reduce());
+    double drift[3];
+    diagnostics_drift(diagnostics, diagnostics_baseline, drift);
+    row.energy_drift = drift[0];
+
+    double position_sum = 0;
+    int compared = 0;
+    for (int id = 0; id < PLANET_COUNT; ++id) {
+        Planet* planet = &working_planets[planet_slot[id]];
+        Planet* expected = &regress_reference[id];
+        if (reference) *expected = *planet;
+
+        bool active = planet_active(planet);
+        if (!active) row.merges += 1;
+        if (active != planet_active(expected)) {
+            row.merge_mismatches += 1;
+        } else if (active) {
+            Vec3 difference = vec3_sub(vec3_unpack(planet->position), vec3_unpack(expected->position));
+            position_sum += difference.x*difference.x + difference.y*difference.y + difference.z*difference.z;
+            compared += 1;
+        }
+    }
+    row.position_rms = compared > 0 ? sqrt(position_sum / compared) : 0;
+    return row;
+}
+
+void regress(int steps) {
+    RegressRow rows[2*KERNELS_COUNT];
+    int row_count = 0;
+
+    for (int sorted = 0; sorted < 2; ++sorted) {
+        for (int k = 0; k < KERNELS_COUNT; ++k) {
+            if (!kernels_supported(k)) continue;
+            kernels_select(k);
+            morton_sort = sorted;
+            rows[row_count] = regress_run(steps, row_count == 0);
+            row_count += 1;
+        }
+    }
+
+    printf("\n%d steps of %d bodies, %s, seed %llu\n", steps, PLANET_COUNT, scenario_names[scenario], (unsigned long long)seed);
+    printf("%-16s %12s %12s %12s %8s %10s %12s %10s %10s\n",
+           "path", "accel rms", "accel max", "energy drift", "merges", "mismatch", "position rms", "ms/step", "B/inter");
+    for (int i = 0; i < row_count; ++i) {
+        RegressRow r = rows[i];
+        printf("%-16s %12.3e %12.3e %12.3e %8d %10d %12.3e %10.2f ",
+               r.name, r.acceleration_rms, r.acceleration_max, r.energy_drift,
+               r.merges, r.merge_mismatches, r.position_rms, r.seconds_per_step*1e3);
+        printf("%10.3f\n", r.bytes_per_interaction);
+    }
+    if (!perf_counting) printf("No perf events, B/inter is estimated from the %zu byte records read\n", sizeof(Planet));
+}
+
+// Frame graph
+//
+// A frame is a handful of jobs and the jobs each one has to wait for. The
+// main thread and FRAME_HELPERS helpers take whichever job is ready, a job
+// split in parts is shared between them. Jobs that touch GL only run on the
+// main thread, the context is current there.
+//
+// Drawing uses the state published by the last frame's simulate job, so the
+// workers run the next batch while this frame's instances are built and sent.
+
+#define FRAME_HELPERS 2
+#define MAX_FRAME_JOBS 16
+
+typedef struct {
+    const char* name;
+    void (*run)(int part);
+    int parts;
+    uint32_t depends;  // bit per job that has to be done first
+    bool main_thread;  // needs the GL context
+    atomic_int next_part;
+    atomic_int done_parts;
+    atomic_ullong nanoseconds;   // this frame, over every part
+    uint64_t report_nanoseconds; // since the last report
+} FrameJob;
+
+typedef struct {
+    FrameJob jobs[MAX_FRAME_JOBS];
+    int count;
+    atomic_uint done; // bit per finished job
+    uint64_t nanoseconds; // the last frame, start to end
+} FrameGraph;
+
+FrameGraph frame_graph;
+pthread_barrier_t frame_start_barrier;
+pthread_barrier_t frame_end_barrier;
+
+int frame_job_add(FrameGraph* graph, const char* name, void (*run)(int part), int parts, uint32_t depends, bool main_thread) {
+    FrameJob* job = &graph->jobs[graph->count];
+    job->name = name;
+    job->run = run;
+    job->parts = parts;
+    job->depends = depends;
+    job->main_thread = main_thread;
+    return graph->count++;
+}
+
+static inline uint64_t frame_nanoseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec*1000000000ull + now.tv_nsec;
+}
+
+// Runs parts of ready jobs until there is nothing left this thread may run
+void frame_graph_work(FrameGraph* graph, bool main_thread) {
+    uint32_t mine = 0;
+    for (int j = 0; j < graph->count; ++j)
+        if (main_thread || !graph->jobs[j].main_thread) mine |= 1u << j;
+
+    while (true) {
+        uint32_t done = atomic_load_explicit(&graph->done, memory_order_acquire);
+        if ((done & mine) == mine) return;
+
+        bool worked = false;
+        for (int j = 0; j < graph->count && !worked; ++j) {
+            FrameJob* job = &graph->jobs[j];
+            if (!(mine & (1u << j)) || (done & (1u << j))) continue;
+            if ((job->depends & done) != job->depends) continue;
+
+            int part = atomic_fetch_add(&job->next_part, 1);
+            if (part >= job->parts) continue;
+
+            uint64_t start = frame_nanoseconds();
+            job->run(part);
+            atomic_fetch_add(&job->nanoseconds, frame_nanoseconds() - start);
+
+            if (atomic_fetch_add_explicit(&job->done_parts, 1, memory_order_acq_rel) + 1 == job->parts)
+                atomic_fetch_or_explicit(&graph->done, 1u << j, memory_order_release);
+            worked = true;
+        }
+        // Leave the cores to the physics while the rest of the frame is busy
+        if (!worked) sched_yield();
+    }
+}
+
+void* frame_helper_thread(void* arg) {
+    while (true) {
+        pthread_barrier_wait(&frame_start_barrier);
+        frame_graph_work(&frame_graph, false);
+        pthread_barrier_wait(&frame_end_barrier);
+    }
+    return NULL;
+}
 
-#define MAX_X 2000.0L
-#define MAX_Y 2000.0L
-#define MAX_Z 1000.0L
+void frame_graph_run(FrameGraph* graph) {
+    for (int j = 0; j < graph->count; ++j) {
+        atomic_store(&graph->jobs[j].next_part, 0);
+        atomic_store(&graph->jobs[j].done_parts, 0);
+        atomic_store(&graph->jobs[j].nanoseconds, 0);
+    }
+    atomic_store(&graph->done, 0);
 
-#define MAX_RADIOUS 10.0L
+    uint64_t start = frame_nanoseconds();
+    pthread_barrier_wait(&frame_start_barrier);
+    frame_graph_work(graph, true);
+    pthread_barrier_wait(&frame_end_barrier);
+    graph->nanoseconds = frame_nanoseconds() - start;
 
-#define MAX_DENSITY 2000000000
-#define MIN_DENSITY 10
+    for (int j = 0; j < graph->count; ++j)
+        graph->jobs[j].report_nanoseconds += graph->jobs[j].nanoseconds;
+}
 
-#define MAX_VELOCITY 0.01
+static inline uint64_t frame_job_nanoseconds(FrameGraph* graph, const char* name) {
+    for (int j = 0; j < graph->count; ++j)
+        if (strcmp(graph->jobs[j].name, name) == 0) return graph->jobs[j].nanoseconds;
+    return 0;
+}
 
-#define randval() ((val_t)rand()/(val_t)RAND_MAX)
+// Time per frame of every job, summed over its parts
+void frame_graph_report(FrameGraph* graph, int frames, double seconds) {
+    printf("Frame: %.2f ms", seconds/frames*1e3);
+    for (int j = 0; j < graph->count; ++j) {
+        FrameJob* job = &graph->jobs[j];
+        printf(", %s %.2f ms", job->name, (double)job->report_nanoseconds/frames*1e-6);
+        job->report_nanoseconds = 0;
+    }
+    printf("\n");
+}
 
-clock_t __perf_start;
-#define PERF_START() __perf_start = clock()
-#define PERF_END(str, scale) printf("Time taken by " str ": %f\n", ((double)(clock() - __perf_start)) / CLOCKS_PER_SEC * (scale))
+// What the jobs of a frame share. The main thread fills it in between
+// frames, from the input and the clock.
+typedef struct {
+    float x, y, z, w; // inside where x*px + y*py + z*pz + w >= 0, unit normal
+} Plane;
 
 typedef struct {
-    bool active;
+    Vec3 camera;       // in world space
+    float pitch, yaw;
+    int width, height;
+    Plane frustum[6];
+    float clip[16];     // projection times view, column major like GL
+    float rotation[16]; // of the view
+    val_t alpha;       // blend from the second to last published state to the last
+    // The last two published states. Simulate publishes over previous_bodies
+    // while the frame runs, so jobs go by these and not render_published.
+    RenderBody* bodies;
+    RenderBody* previous_bodies;
+    size_t sim_step;
+    int sim_count;     // steps this frame, run as one batch so it publishes once
+    bool draw;         // off for the frames an offscreen run doesn't record
+    bool record;
+} Frame;
+
+Frame frame;
+
+// Bodies checked and culled by each visibility part, the last frame
+int frame_active[CORE_N];
+int frame_culled[CORE_N];
+
+// Column major, like GL
+static inline void mat4_mult(const float a[16], const float b[16], float out[16]) {
+    for (int col = 0; col < 4; ++col)
+        for (int row = 0; row < 4; ++row) {
+            float sum = 0;
+            for (int k = 0; k < 4; ++k) sum += a[k*4 + row] * b[col*4 + k];
+            out[col*4 + row] = sum;
+        }
+}
+
+static inline void mat4_rotation(float degrees, float x, float y, float z, float out[16]) {
+    float c = cos(degrees*M_PI/180), s = sin(degrees*M_PI/180);
+    float m[16] = {
+        x*x*(1-c)+c,   y*x*(1-c)+z*s, x*z*(1-c)-y*s, 0,
+        x*y*(1-c)-z*s, y*y*(1-c)+c,   y*z*(1-c)+x*s, 0,
+        x*z*(1-c)+y*s, y*z*(1-c)-x*s, z*z*(1-c)+c,   0,
+        0,             0,             0,             1,
+    };
+    memcpy(out, m, sizeof(m));
+}
+
+// Planes of the view volume, from the same matrices the frame draws with
+// (Gribb and Hartmann's extraction from the combined matrix). The matrices
+// are kept for the software rasterizer.
+void frame_frustum_update(Frame* f) {
+    double focal = cad_viz_focal(FOV_Y);
+    float near = 1, far = 1000000, aspect = 16.0/9.0;
+    float projection[16] = {
+        focal/aspect, 0,     0,                           0,
+        0,            focal, 0,                           0,
+        0,            0,     (far+near)/(near-far),      -1,
+        0,            0,     (2*far*near)/(near-far),     0,
+    };
+
+    float pitch[16], yaw[16], rotation[16], view[16], clip[16];
+    float translation[16] = {1,0,0,0, 0,1,0,0, 0,0,1,0, -f->camera.x, -f->camera.y, -f->camera.z, 1};
+    mat4_rotation(f->pitch, 1, 0, 0, pitch);
+    mat4_rotation(f->yaw,   0, 1, 0, yaw);
+    mat4_mult(pitch, yaw, rotation);
+    mat4_mult(rotation, translation, view);
+    mat4_mult(projection, view, clip);
+    memcpy(f->clip, clip, sizeof(clip));
+    memcpy(f->rotation, rotation, sizeof(rotation));
+
+    // Left, right, bottom, top, near, far: the last row plus or minus another
+    for (int i = 0; i < 6; ++i) {
+        int row = i/2;
+        float sign = i%2 == 0 ? 1 : -1;
+        Plane p = {
+            clip[3]  + sign*clip[row],
+            clip[7]  + sign*clip[4 + row],
+            clip[11] + sign*clip[8 + row],
+            clip[15] + sign*clip[12 + row],
+        };
+        float length = sqrt(p.x*p.x + p.y*p.y + p.z*p.z);
+        f->frustum[i] = (Plane){p.x/length, p.y/length, p.z/length, p.w/length};
+    }
+}
+
+static inline bool frustum_sphere_outside(const Plane frustum[6], Vec3 center, val_t radious) {
+    for (int i = 0; i < 6; ++i) {
+        const Plane* p = &frustum[i];
+        if (p->x*center.x + p->y*center.y + p->z*center.z + p->w < -radious) return true;
+    }
+    return false;
+}
+
+// Drawn state of a body, by id
+typedef struct {
+    bool visible;
+    int level;         // LOD, kept from frame to frame
+    bool impostor;
     Vec3 position;
-    Vec3 velocity;
-    Vec3 acceleration;
-    Vec3 color;
-    val_t radious;
-    val_t mass;
-} Planet;
+    float distance_to_camera;
+} RenderItem;
+
+RenderItem render_items[PLANET_COUNT];
+
+CAD planet_bases[PLANET_LOD_LEVELS]; // by Catmull-Clark subdivisions
+float planet_lod_error[PLANET_LOD_LEVELS]; // relative to the diameter
+float planet_lod_extent[PLANET_LOD_LEVELS]; // farthest point, relative to the radious
+int planet_lod_triangles[PLANET_LOD_LEVELS];
+float planet_mesh_radious = 0.5; // mean, of the finest mesh before it is scaled
+
+// How far each level strays from the finest one: its points and the centers
+// of its faces, against the finest point in the same direction.
+val_t planet_lod_deviation(Vec3 p) {
+    CAD finest = planet_bases[PLANET_LOD_LEVELS-1];
+    val_t length = vec3_length(p);
+    val_t best = -2, radious = length;
+    for (size_t i = 0; i < finest.points.count; ++i) {
+        Vec3 q = finest.points.items[i];
+        val_t q_length = vec3_length(q);
+        val_t cosine = (p.x*q.x + p.y*q.y + p.z*q.z) / (length*q_length);
+        if (cosine > best) {
+            best = cosine;
+            radious = q_length;
+        }
+    }
+    return fabs(length - radious);
+}
 
-#define G 6.67430e-11 
+void planet_lods_init() {
+    CAD finest = planet_bases[PLANET_LOD_LEVELS-1];
+    val_t diameter = 0, mean = 0;
+    for (size_t i = 0; i < finest.points.count; ++i) {
+        diameter = max(diameter, 2*vec3_length(finest.points.items[i]));
+        mean += vec3_length(finest.points.items[i]) / finest.points.count;
+    }
+    planet_mesh_radious = mean;
+
+    for (int level = 0; level < PLANET_LOD_LEVELS; ++level) {
+        CAD base = planet_bases[level];
+        val_t deviation = 0, extent = 0;
+        for (size_t i = 0; i < base.points.count; ++i) {
+            deviation = max(deviation, planet_lod_deviation(base.points.items[i]));
+            extent = max(extent, vec3_length(base.points.items[i]));
+        }
+        planet_lod_extent[level] = 2*extent; // meshes are scaled by the diameter
 
-#define CAM_VELOCITY 0.1
+        planet_lod_triangles[level] = 0;
+        for (size_t i = 0; i < base.faces.count; ++i) {
+            if (base.faces.items[i].count < 3) continue;
+            deviation = max(deviation, planet_lod_deviation(get_face_center(base, i)));
+            planet_lod_triangles[level] += base.faces.items[i].count - 2;
+        }
+        planet_lod_error[level] = deviation / diameter;
+    }
+}
 
-val_t dt; // = 1/60 * time_warping;
+// Instanced drawing
+//
+// Every base mesh lives in vertex and index buffers, as cadigo exports it
+// with flat normals. Bodies only send where they are, how big and what
+// color, and a shader places and shades the mesh. That's one draw call per
+// mesh in use, whatever the number of bodies.
+//
+// Bodies only a few pixels across are impostors instead: one point each,
+// grown to the size of the body and shaded as a sphere in the fragment
+// shader, with the same lighting as the meshes.
+//
+// The instances are built in CORE_N parts, each part into its own batch of
+// lists, and submit copies the batches one after the other into the
+// instance buffer. There's still a single draw call per list.
 
-Planet working_planets[PLANET_COUNT];
-Planet ref_planets[PLANET_COUNT];
+typedef struct {
+    GLuint vertex_buffer;
+    GLuint index_buffer;
+    GLsizei indexes;
+} PlanetMesh;
 
 typedef struct {
-    int from;
-    int to;
-} PlanetsThreadData;
+    float x, y, z;
+    float radious;
+    float r, g, b;  // with the distance dimming in
+} PlanetInstance;
 
-pthread_barrier_t end_barrier;
-pthread_barrier_t start_collision_barrier;
-pthread_barrier_t collision_barrier;
-pthread_barrier_t updated_ref_barrier;
+typedef struct {
+    size_t count;
+    size_t capacity;
+    PlanetInstance* items;
+} PlanetInstances;
+
+#define IMPOSTOR_LIST PLANET_LOD_LEVELS // after a list per mesh
+#define INSTANCE_LISTS (PLANET_LOD_LEVELS+1)
+
+PlanetMesh planet_meshes[PLANET_LOD_LEVELS];
+// Impostors carry the radious of the sphere the meshes look like
+PlanetInstances planet_batches[CORE_N][INSTANCE_LISTS];
+int frame_triangles; // the last frame
+int frame_impostors;
+GLuint instance_buffer;
+GLuint planet_program;
+GLint corner_attribute, normal_attribute, instance_attribute, color_attribute;
+GLuint impostor_program;
+GLint impostor_instance_attribute, impostor_color_attribute;
+
+const char* planet_vertex_shader =
+    "#version 120\n"
+    "attribute vec3 corner;\n"
+    "attribute vec3 normal;\n"
+    "attribute vec4 instance;\n" // position, radious
+    "attribute vec3 color;\n"
+    "uniform float ambient_light;\n"
+    "uniform float brightness;\n"
+    "varying vec3 shaded;\n"
+    "void main() {\n"
+    "    shaded = color * (normal.z + ambient_light) * brightness;\n"
+    "    gl_Position = gl_ModelViewProjectionMatrix * vec4(instance.xyz + corner * 2.0*instance.w, 1.0);\n"
+    "}\n";
+
+const char* planet_fragment_shader =
+    "#version 120\n"
+    "varying vec3 shaded;\n"
+    "void main() {\n"
+    "    gl_FragColor = vec4(shaded, 1.0);\n"
+    "}\n";
+
+const char* impostor_vertex_shader =
+    "#version 120\n"
+    "attribute vec4 instance;\n" // position, radious
+    "attribute vec3 color;\n"
+    "uniform float viewport_height;\n"
+    "varying vec3 dimmed;\n"
+    "void main() {\n"
+    "    dimmed = color;\n"
+    "    vec4 eye = gl_ModelViewMatrix * vec4(instance.xyz, 1.0);\n"
+    "    gl_Position = gl_ProjectionMatrix * eye;\n"
+    "    gl_PointSize = max(instance.w * gl_ProjectionMatrix[1][1] * viewport_height / -eye.z, 1.0);\n"
+    "}\n";
+
+// The normal comes from where the fragment is on the point, in eye space,
+// and goes back to world space. cadigo winds the base faces so that their
+// normals point inwards, and that's what the meshes are lit with.
+const char* impostor_fragment_shader =
+    "#version 120\n"
+    "uniform float ambient_light;\n"
+    "uniform float brightness;\n"
+    "varying vec3 dimmed;\n"
+    "void main() {\n"
+    "    vec2 p = gl_PointCoord*2.0 - 1.0;\n"
+    "    float r2 = dot(p, p);\n"
+    "    if (r2 > 1.0) discard;\n"
+    "    vec3 normal = -(vec3(p.x, -p.y, sqrt(1.0 - r2)) * gl_NormalMatrix);\n"
+    "    gl_FragColor = vec4(dimmed * (normal.z + ambient_light) * brightness, 1.0);\n"
+    "}\n";
+
+GLuint shader_compile(GLenum type, const char* source) {
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+
+    GLint compiled;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+    if (!compiled) {
+        char log[1024];
+        glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+        fprintf(stderr, "Failed to compile shader: %s\n", log);
+        exit(1);
+    }
+    return shader;
+}
 
-void* planets_thread(void* arg) {
-    PlanetsThreadData data = *(PlanetsThreadData*)arg;
-    printf("Processing from %d to %d\n", data.from, data.to);
-    // Collisions
-    while(true) {
-        pthread_barrier_wait(&start_collision_barrier);
-        for (size_t index = data.from; index < data.to; ++index) {
-            if (!working_planets[index].active) continue;
-            Planet* planet = &working_planets[index];
+GLuint shader_program(const char* vertex_source, const char* fragment_source) {
+    GLuint program = glCreateProgram();
+    glAttachShader(program, shader_compile(GL_VERTEX_SHADER, vertex_source));
+    glAttachShader(program, shader_compile(GL_FRAGMENT_SHADER, fragment_source));
+    glLinkProgram(program);
+
+    GLint linked;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    if (!linked) {
+        char log[1024];
+        glGetProgramInfoLog(program, sizeof(log), NULL, log);
+        fprintf(stderr, "Failed to link shaders: %s\n", log);
+        exit(1);
+    }
 
-            for (size_t other_index = 0; other_index < PLANET_COUNT; ++other_index) {
-                Planet* other_planet = &ref_planets[other_index];
+    glUseProgram(program);
+    glUniform1f(glGetUniformLocation(program, "ambient_light"), AMBIENT_LIGHT);
+    glUniform1f(glGetUniformLocation(program, "brightness"), BRIGHTNESS);
+    glUseProgram(0);
+    return program;
+}
 
-                if (other_index == index) continue;
-                if (!other_planet->active) continue;
-                
-                Vec3 difference = vec3_sub(other_planet->position, planet->position);
+// Needs the GL context, so it runs once the window is up
+void planet_meshes_init() {
+    for (int res = 0; res < PLANET_LOD_LEVELS; ++res) {
+        TriangleMesh mesh = cad_to_triangle_mesh(planet_bases[res], false);
+        PlanetMesh* planet_mesh = &planet_meshes[res];
 
-                val_t square_distance = difference.x * difference.x
-                                      + difference.y * difference.y
-                                      + difference.z * difference.z;
+        glGenBuffers(1, &planet_mesh->vertex_buffer);
+        glBindBuffer(GL_ARRAY_BUFFER, planet_mesh->vertex_buffer);
+        glBufferData(GL_ARRAY_BUFFER, mesh.vertex_count*CAD_MESH_STRIDE*sizeof(float), mesh.vertices, GL_STATIC_DRAW);
 
-                val_t radious_sum = planet->radious + other_planet->radious;
+        glGenBuffers(1, &planet_mesh->index_buffer);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, planet_mesh->index_buffer);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, mesh.index_count*sizeof(uint32_t), mesh.indexes, GL_STATIC_DRAW);
+        planet_mesh->indexes = mesh.index_count;
 
-                bool planets_collided = square_distance < (radious_sum*radious_sum);
-                //if (planets_collided) printf("collided\n");
-                //if (!planets_collided) printf("didn't collide\n");
-                if (planets_collided) {
-                    val_t wsum = planet->mass + other_planet->mass;
-                    val_t weight1 = planet->mass / wsum;
-                    val_t weight2 = other_planet->mass / wsum;
+        free_triangle_mesh(mesh);
+    }
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    glGenBuffers(1, &instance_buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    planet_program = shader_program(planet_vertex_shader, planet_fragment_shader);
+    corner_attribute   = glGetAttribLocation(planet_program, "corner");
+    normal_attribute   = glGetAttribLocation(planet_program, "normal");
+    instance_attribute = glGetAttribLocation(planet_program, "instance");
+    color_attribute    = glGetAttribLocation(planet_program, "color");
+
+    impostor_program = shader_program(impostor_vertex_shader, impostor_fragment_shader);
+    impostor_instance_attribute = glGetAttribLocation(impostor_program, "instance");
+    impostor_color_attribute    = glGetAttribLocation(impostor_program, "color");
+    glEnable(GL_VERTEX_PROGRAM_POINT_SIZE);
+    glEnable(GL_POINT_SPRITE);
+}
 
-                    if (index > other_index) {
-                        planet->active = false;
-                    } else {
-                    
-                        planet->mass += other_planet->mass;
+// Load shedding
+//
+// With a frame budget set, the controller watches how long frames take and
+// steps down a ladder of render qualities until they fit, then back up once
+// there is room to spare. When the simulation is what takes the time, it
+// caps the steps per frame instead, the simulation falls behind the clock
+// rather than the frame rate dropping.
 
-                        vec3_mult_by_s(&planet->color, weight1);
-                        vec3_add_to(&planet->color, vec3_mult_s(other_planet->color, weight2));
+typedef struct {
+    float error_pixels;    // LOD error allowed on screen
+    int max_level;         // finest LOD
+    float impostor_pixels; // smaller bodies on screen are points
+    float min_pixels;      // smaller bodies on screen aren't drawn
+} Quality;
+
+Quality qualities[] = {
+    {LOD_ERROR_PIXELS,    PLANET_LOD_LEVELS-1, IMPOSTOR_PIXELS,   0  },
+    {LOD_ERROR_PIXELS*2,  PLANET_LOD_LEVELS-1, IMPOSTOR_PIXELS*2, 0.5},
+    {LOD_ERROR_PIXELS*4,  3,                   IMPOSTOR_PIXELS*3, 1  },
+    {LOD_ERROR_PIXELS*8,  2,                   IMPOSTOR_PIXELS*4, 1  },
+    {LOD_ERROR_PIXELS*16, 1,                   IMPOSTOR_PIXELS*6, 2  },
+};
+#define QUALITY_COUNT (int)(sizeof(qualities)/sizeof(qualities[0]))
+
+#define SHED_SMOOTHING 0.1      // weight of the last frame in the average
+#define SHED_COOLDOWN 15        // frames after a change before the next one
+#define RESTORE_COOLDOWN 120
+#define RESTORE_HEADROOM 0.6    // of the budget, before quality goes back up
 
-                        vec3_mult_by_s(&planet->color, 1/vec3_max(planet->color));
+typedef struct {
+    double budget;     // seconds per frame, 0 when off
+    double average;    // smoothed frame time
+    int level;         // into qualities
+    int max_steps;     // simulation steps per frame
+    int cooldown;
+} LoadShedding;
+
+LoadShedding load_shedding = {.max_steps = MAX_STEPS_PER_FRAME};
+Quality quality;
+
+void load_shedding_log(LoadShedding* shedding, const char* decision) {
+    Quality q = qualities[shedding->level];
+    printf("Load shedding: %s, %.1f ms per frame for a %.1f ms budget. Quality %d: LOD error up to %.1f px, %d subdivisions at most, "
+           "points under %.0f px, bodies under %.1f px skipped, %d steps per frame at most\n",
+           decision, shedding->average*1e3, shedding->budget*1e3, shedding->level,
+           q.error_pixels, q.max_level, q.impostor_pixels, q.min_pixels, shedding->max_steps);
+}
 
-                        vec3_mult_by_s(&planet->position, weight1);
-                        vec3_add_to(&planet->position, vec3_mult_s(other_planet->position, weight2));
+// Called after every frame. Steps can only be shed with fixed steps, with
+// batches the batch size already follows the frame rate.
+void load_shedding_update(LoadShedding* shedding, FrameGraph* graph, bool fixed_steps) {
+    double frame_seconds = graph->nanoseconds*1e-9;
+    shedding->average = shedding->average == 0 ? frame_seconds : shedding->average*(1-SHED_SMOOTHING) + frame_seconds*SHED_SMOOTHING;
+    if (shedding->cooldown > 0) {
+        shedding->cooldown -= 1;
+        return;
+    }
 
-                        vec3_mult_by_s(&planet->velocity, weight1);
-                        vec3_add_to(&planet->velocity, vec3_mult_s(other_planet->velocity, weight2));
+    // Whichever side took longer gets cut first, and gets back its quality
+    // last. Drawing worse can't help a frame the simulation holds up, so
+    // when the steps can't be cut (batches size themselves) nothing is.
+    uint64_t simulate = frame_job_nanoseconds(graph, "simulate");
+    uint64_t render = frame_job_nanoseconds(graph, "instances") + frame_job_nanoseconds(graph, "submit") +
+                      frame_job_nanoseconds(graph, "bin") + frame_job_nanoseconds(graph, "raster");
+    bool simulation_bound = simulate > render;
+
+    if (shedding->average > shedding->budget) {
+        if (simulation_bound && fixed_steps && shedding->max_steps > 1) {
+            shedding->max_steps /= 2;
+            load_shedding_log(shedding, "fewer steps");
+        } else if (simulation_bound) {
+            load_shedding_log(shedding, "simulation bound, quality kept");
+        } else if (shedding->level < QUALITY_COUNT-1) {
+            shedding->level += 1;
+            load_shedding_log(shedding, "lower quality");
+        } else return;
+        shedding->cooldown = SHED_COOLDOWN;
+    } else if (shedding->average < shedding->budget*RESTORE_HEADROOM) {
+        if (shedding->level > 0 && (simulation_bound || shedding->max_steps == MAX_STEPS_PER_FRAME)) {
+            shedding->level -= 1;
+            load_shedding_log(shedding, "higher quality");
+        } else if (shedding->max_steps < MAX_STEPS_PER_FRAME) {
+            shedding->max_steps *= 2;
+            load_shedding_log(shedding, "more steps");
+        } else return;
+        shedding->cooldown = RESTORE_COOLDOWN;
+    }
+}
 
-                        planet->radious = max(planet->radious, other_planet->radious);
+// Coarsest level whose error on screen is within the limit. Going back to a
+// coarser level needs some margin, so bodies right at a threshold don't flip
+// between two meshes every frame.
+static inline int lod_select(int current, float pixels) {
+    current = min(current, quality.max_level);
+    int wanted = quality.max_level;
+    for (int level = 0; level < quality.max_level; ++level) {
+        if (pixels*planet_lod_error[level] <= quality.error_pixels) {
+            wanted = level;
+            break;
+        }
+    }
+    if (wanted >= current) return wanted;
+
+    for (int level = wanted; level < current; ++level)
+        if (pixels*planet_lod_error[level] <= quality.error_pixels*LOD_HYSTERESIS) return level;
+    return current;
+}
+
+void frame_visibility(int part) {
+    RenderBody* previous_bodies = frame.previous_bodies;
+    RenderBody* current_bodies  = frame.bodies;
+
+    int active = 0, culled = 0;
+    for (size_t id = (size_t)part*PLANET_COUNT/CORE_N; frame.draw && id < (size_t)(part+1)*PLANET_COUNT/CORE_N; ++id) {
+        RenderBody* body = &current_bodies[id];
+        RenderItem* item = &render_items[id];
+        item->visible = body->active;
+        if (!item->visible) continue;
+        active += 1;
+
+        item->position = vec3_add(previous_bodies[id].position, vec3_mult_s(vec3_sub(body->position, previous_bodies[id].position), frame.alpha));
+
+        item->distance_to_camera = vec3_length(vec3_sub(item->position, frame.camera));
+
+        // Size on screen, with the same projection as cad_viz_glPerspective
+        float pixels = 2*body->radious / item->distance_to_camera * cad_viz_focal(FOV_Y) * frame.height/2;
+        item->level = lod_select(item->level, pixels);
+        item->impostor = pixels < quality.impostor_pixels;
+
+        // Coarse meshes reach past the radious, the cube of level 0 by most
+        float extent = item->impostor ? 2*planet_mesh_radious : planet_lod_extent[item->level];
+        if (frustum_sphere_outside(frame.frustum, item->position, body->radious*extent)) {
+            item->visible = false;
+            culled += 1;
+            continue;
+        }
+        item->visible = pixels >= quality.min_pixels;
+    }
+    frame_active[part] = active;
+    frame_culled[part] = culled;
+}
+
+void frame_simulate(int part) {
+    if (frame.sim_count > 0) frame.sim_step += simulation_steps(frame.sim_step, frame.sim_count);
+}
+
+void frame_instances_build(int part) {
+    RenderBody* current_bodies = frame.bodies;
+    PlanetInstances* batch = planet_batches[part];
+
+    for (int list = 0; list < INSTANCE_LISTS; ++list) batch[list].count = 0;
+    for (size_t id = (size_t)part*PLANET_COUNT/CORE_N; frame.draw && id < (size_t)(part+1)*PLANET_COUNT/CORE_N; ++id) {
+        RenderItem* item = &render_items[id];
+        if (!item->visible) continue;
+        RenderBody* body = &current_bodies[id];
+
+        float dimming = max(1.0-(item->distance_to_camera*0.0001), 0.2);
+        PlanetInstance instance = {
+            item->position.x, item->position.y, item->position.z, body->radious,
+            body->color.x*dimming, body->color.y*dimming, body->color.z*dimming,
+        };
+        if (item->impostor) {
+            // Meshes are scaled by the diameter
+            instance.radious = body->radious*2*planet_mesh_radious;
+            da_append(&batch[IMPOSTOR_LIST], instance);
+            continue;
+        }
+        da_append(&batch[item->level], instance);
+    }
+}
+
+// Fills the instance buffer with a list from every batch, returns how many
+// instances there are
+size_t instance_buffer_upload(int list) {
+    size_t count = 0;
+    for (int part = 0; part < CORE_N; ++part) count += planet_batches[part][list].count;
+    if (count == 0) return 0;
+
+    glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+    glBufferData(GL_ARRAY_BUFFER, count*sizeof(PlanetInstance), NULL, GL_STREAM_DRAW);
+    size_t offset = 0;
+    for (int part = 0; part < CORE_N; ++part) {
+        PlanetInstances* instances = &planet_batches[part][list];
+        if (instances->count == 0) continue;
+        glBufferSubData(GL_ARRAY_BUFFER, offset*sizeof(PlanetInstance), instances->count*sizeof(PlanetInstance), instances->items);
+        offset += instances->count;
+    }
+    return count;
+}
+
+void frame_submit(int part) {
+    if (!frame.draw) return;
+    glViewport(0, 0, frame.width, frame.height);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glLoadIdentity();
+    glRotatef(frame.pitch, 1.0, 0.0, 0.0);
+    glRotatef(frame.yaw  , 0.0, 1.0, 0.0);
+    glTranslatef(-frame.camera.x, -frame.camera.y, -frame.camera.z);
+
+    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+    glUseProgram(planet_program);
+    glEnableVertexAttribArray(corner_attribute);
+    glEnableVertexAttribArray(normal_attribute);
+    glEnableVertexAttribArray(instance_attribute);
+    glEnableVertexAttribArray(color_attribute);
+    glVertexAttribDivisor(instance_attribute, 1);
+    glVertexAttribDivisor(color_attribute, 1);
+
+    frame_triangles = 0;
+    for (int res = 0; res < PLANET_LOD_LEVELS; ++res) {
+        size_t count = instance_buffer_upload(res);
+        if (count == 0) continue;
+        frame_triangles += count*planet_lod_triangles[res];
+
+        glVertexAttribPointer(instance_attribute, 4, GL_FLOAT, GL_FALSE, sizeof(PlanetInstance), (void*)offsetof(PlanetInstance, x));
+        glVertexAttribPointer(color_attribute,    3, GL_FLOAT, GL_FALSE, sizeof(PlanetInstance), (void*)offsetof(PlanetInstance, r));
+
+        glBindBuffer(GL_ARRAY_BUFFER, planet_meshes[res].vertex_buffer);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, planet_meshes[res].index_buffer);
+        glVertexAttribPointer(corner_attribute, 3, GL_FLOAT, GL_FALSE, CAD_MESH_STRIDE*sizeof(float), (void*)0);
+        glVertexAttribPointer(normal_attribute, 3, GL_FLOAT, GL_FALSE, CAD_MESH_STRIDE*sizeof(float), (void*)(3*sizeof(float)));
+
+        glDrawElementsInstanced(GL_TRIANGLES, planet_meshes[res].indexes, GL_UNSIGNED_INT, (void*)0, count);
+    }
+
+    glVertexAttribDivisor(instance_attribute, 0);
+    glVertexAttribDivisor(color_attribute, 0);
+    glDisableVertexAttribArray(color_attribute);
+    glDisableVertexAttribArray(instance_attribute);
+    glDisableVertexAttribArray(normal_attribute);
+    glDisableVertexAttribArray(corner_attribute);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+    frame_impostors = instance_buffer_upload(IMPOSTOR_LIST);
+    if (frame_impostors > 0) {
+        glUseProgram(impostor_program);
+        glUniform1f(glGetUniformLocation(impostor_program, "viewport_height"), frame.height);
+        glEnableVertexAttribArray(impostor_instance_attribute);
+        glEnableVertexAttribArray(impostor_color_attribute);
+
+        glVertexAttribPointer(impostor_instance_attribute, 4, GL_FLOAT, GL_FALSE, sizeof(PlanetInstance), (void*)offsetof(PlanetInstance, x));
+        glVertexAttribPointer(impostor_color_attribute,    3, GL_FLOAT, GL_FALSE, sizeof(PlanetInstance), (void*)offsetof(PlanetInstance, r));
+        glDrawArrays(GL_POINTS, 0, frame_impostors);
+
+        glDisableVertexAttribArray(impostor_color_attribute);
+        glDisableVertexAttribArray(impostor_instance_attribute);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glUseProgram(0);
+}
+
+// Software rasterizer
+//
+// For machines without a GPU. It draws the same instances as GL, from the
+// same meshes, into an RGBA buffer. The bin job splits in the same parts as
+// the instances: each part projects its bodies and lists, per screen tile,
+// the triangles and impostor discs that touch it. The raster job then takes
+// a tile per part, clears it and draws what the bins hold, with its own
+// stretch of the depth buffer, so no two parts write the same pixel.
+//
+// Triangles that cross the near plane are dropped rather than clipped.
+
+#define TILE_SIZE 32
+#define TILES_X ((FRAME_WIDTH + TILE_SIZE-1)/TILE_SIZE)
+#define TILES_Y ((FRAME_HEIGHT + TILE_SIZE-1)/TILE_SIZE)
+#define TILE_COUNT (TILES_X*TILES_Y)
+#define RASTER_NEAR 1 // same as the GL projection
+
+typedef struct {
+    float x[3], y[3]; // window coordinates, y up like GL
+    float z[3];       // depth, -1 to 1
+    uint32_t color;   // RGBA, shaded
+} RasterTriangle;
+
+typedef struct {
+    float x, y, z;
+    float radious;    // in pixels
+    float r, g, b;    // dimmed, shaded per pixel
+} RasterDisc;
+
+typedef struct {
+    size_t count;
+    size_t capacity;
+    RasterTriangle* items;
+} RasterTriangles;
+
+typedef struct {
+    size_t count;
+    size_t capacity;
+    RasterDisc* items;
+} RasterDiscs;
+
+typedef struct {
+    size_t count;
+    size_t capacity;
+    uint32_t* items;
+} TileBin;
+
+// What a bin part projected, and which of it touches each tile
+typedef struct {
+    RasterTriangles triangles;
+    RasterDiscs discs;
+    TileBin triangle_bins[TILE_COUNT];
+    TileBin disc_bins[TILE_COUNT];
+} RasterBatch;
+
+TriangleMesh raster_meshes[PLANET_LOD_LEVELS];
+RasterBatch raster_batches[CORE_N];
+uint32_t* raster_pixels; // RGBA, bottom row first like GL
+float* raster_depth;
+
+void raster_init() {
+    for (int res = 0; res < PLANET_LOD_LEVELS; ++res)
+        raster_meshes[res] = cad_to_triangle_mesh(planet_bases[res], false);
+    raster_pixels = malloc(FRAME_WIDTH*FRAME_HEIGHT*sizeof(uint32_t));
+    raster_depth  = malloc(FRAME_WIDTH*FRAME_HEIGHT*sizeof(float));
+}
+
+static inline uint32_t raster_rgba(float r, float g, float b) {
+    uint32_t red   = min(r, 1.0f)*255 + 0.5f;
+    uint32_t green = min(g, 1.0f)*255 + 0.5f;
+    uint32_t blue  = min(b, 1.0f)*255 + 0.5f;
+    return red | green << 8 | blue << 16 | 0xFFu << 24;
+}
+
+// Tiles a window space box touches, false when it's off screen
+static inline bool raster_tiles(float x0, float y0, float x1, float y1, int* tx0, int* ty0, int* tx1, int* ty1) {
+    if (x1 < 0 || y1 < 0 || x0 >= frame.width || y0 >= frame.height) return false;
+    *tx0 = max(x0, 0) / TILE_SIZE;
+    *ty0 = max(y0, 0) / TILE_SIZE;
+    *tx1 = min(x1, frame.width-1) / TILE_SIZE;
+    *ty1 = min(y1, frame.height-1) / TILE_SIZE;
+    return true;
+}
+
+void frame_bin(int part) {
+    RasterBatch* batch = &raster_batches[part];
+    batch->triangles.count = 0;
+    batch->discs.count = 0;
+    for (int tile = 0; tile < TILE_COUNT; ++tile) {
+        batch->triangle_bins[tile].count = 0;
+        batch->disc_bins[tile].count = 0;
+    }
+    if (!frame.draw) return;
+
+    const float* m = frame.clip;
+    float half_width = frame.width*0.5f, half_height = frame.height*0.5f;
+    int tx0, ty0, tx1, ty1;
+
+    for (int res = 0; res < PLANET_LOD_LEVELS; ++res) {
+        PlanetInstances* instances = &planet_batches[part][res];
+        TriangleMesh* mesh = &raster_meshes[res];
+        for (size_t i = 0; i < instances->count; ++i) {
+            PlanetInstance* instance = &instances->items[i];
+            float scale = 2*instance->radious;
+
+            for (size_t t = 0; t + 2 < mesh->index_count; t += 3) {
+                RasterTriangle triangle;
+                bool behind = false;
+                for (int k = 0; k < 3; ++k) {
+                    float* vertex = &mesh->vertices[mesh->indexes[t+k]*CAD_MESH_STRIDE];
+                    float x = instance->x + vertex[0]*scale;
+                    float y = instance->y + vertex[1]*scale;
+                    float z = instance->z + vertex[2]*scale;
+                    float w = m[3]*x + m[7]*y + m[11]*z + m[15];
+                    if (w < RASTER_NEAR) {
+                        behind = true;
+                        break;
                     }
+                    triangle.x[k] = ((m[0]*x + m[4]*y + m[8]*z  + m[12])/w + 1)*half_width;
+                    triangle.y[k] = ((m[1]*x + m[5]*y + m[9]*z  + m[13])/w + 1)*half_height;
+                    triangle.z[k] =  (m[2]*x + m[6]*y + m[10]*z + m[14])/w;
                 }
+                if (behind) continue;
+
+                // cadigo's faces wind clockwise seen from outside
+                float area = (triangle.x[1]-triangle.x[0])*(triangle.y[2]-triangle.y[0]) -
+                             (triangle.x[2]-triangle.x[0])*(triangle.y[1]-triangle.y[0]);
+                if (area >= 0) continue;
+
+                float x0 = min(min(triangle.x[0], triangle.x[1]), triangle.x[2]);
+                float y0 = min(min(triangle.y[0], triangle.y[1]), triangle.y[2]);
+                float x1 = max(max(triangle.x[0], triangle.x[1]), triangle.x[2]);
+                float y1 = max(max(triangle.y[0], triangle.y[1]), triangle.y[2]);
+                if (!raster_tiles(x0, y0, x1, y1, &tx0, &ty0, &tx1, &ty1)) continue;
+
+                // Flat normals, the same lighting as the shader
+                float normal_z = mesh->vertices[mesh->indexes[t]*CAD_MESH_STRIDE + 5];
+                float light = (normal_z + AMBIENT_LIGHT)*BRIGHTNESS;
+                triangle.color = raster_rgba(instance->r*light, instance->g*light, instance->b*light);
+
+                uint32_t index = batch->triangles.count;
+                da_append(&batch->triangles, triangle);
+                for (int ty = ty0; ty <= ty1; ++ty)
+                    for (int tx = tx0; tx <= tx1; ++tx)
+                        da_append(&batch->triangle_bins[ty*TILES_X + tx], index);
             }
         }
+    }
+
+    PlanetInstances* impostors = &planet_batches[part][IMPOSTOR_LIST];
+    for (size_t i = 0; i < impostors->count; ++i) {
+        PlanetInstance* instance = &impostors->items[i];
+        float w = m[3]*instance->x + m[7]*instance->y + m[11]*instance->z + m[15];
+        if (w < RASTER_NEAR) continue;
+
+        // The point size of the impostor shader, halved
+        RasterDisc disc = {
+            .x = ((m[0]*instance->x + m[4]*instance->y + m[8]*instance->z  + m[12])/w + 1)*half_width,
+            .y = ((m[1]*instance->x + m[5]*instance->y + m[9]*instance->z  + m[13])/w + 1)*half_height,
+            .z =  (m[2]*instance->x + m[6]*instance->y + m[10]*instance->z + m[14])/w,
+            .radious = max(instance->radious*m[5]*frame.height/w, 1.0f)*0.5f,
+            .r = instance->r, .g = instance->g, .b = instance->b,
+        };
+        if (!raster_tiles(disc.x - disc.radious, disc.y - disc.radious, disc.x + disc.radious, disc.y + disc.radious, &tx0, &ty0, &tx1, &ty1)) continue;
+
+        uint32_t index = batch->discs.count;
+        da_append(&batch->discs, disc);
+        for (int ty = ty0; ty <= ty1; ++ty)
+            for (int tx = tx0; tx <= tx1; ++tx)
+                da_append(&batch->disc_bins[ty*TILES_X + tx], index);
+    }
+}
 
-        //printf("waiting on collisions, thread from %d to %d\n", data.from, data.to);
-        pthread_barrier_wait(&collision_barrier);
-        //printf("beggining loop, thread from %d to %d\n", data.from, data.to);
+static void raster_triangle(const RasterTriangle* triangle, int x0, int y0, int x1, int y1) {
+    const float* x = triangle->x;
+    const float* y = triangle->y;
+    x0 = max(x0, (int)floorf(min(min(x[0], x[1]), x[2])));
+    y0 = max(y0, (int)floorf(min(min(y[0], y[1]), y[2])));
+    x1 = min(x1, (int)ceilf(max(max(x[0], x[1]), x[2])));
+    y1 = min(y1, (int)ceilf(max(max(y[0], y[1]), y[2])));
+
+    // Clockwise, so each edge function is negative inside
+    float area = (x[1]-x[0])*(y[2]-y[0]) - (x[2]-x[0])*(y[1]-y[0]);
+    for (int py = y0; py < y1; ++py) {
+        float cy = py + 0.5f;
+        for (int px = x0; px < x1; ++px) {
+            float cx = px + 0.5f;
+            float e0 = (x[2]-x[1])*(cy-y[1]) - (y[2]-y[1])*(cx-x[1]);
+            float e1 = (x[0]-x[2])*(cy-y[2]) - (y[0]-y[2])*(cx-x[2]);
+            float e2 = (x[1]-x[0])*(cy-y[0]) - (y[1]-y[0])*(cx-x[0]);
+            if (e0 > 0 || e1 > 0 || e2 > 0) continue;
+
+            float depth = (e0*triangle->z[0] + e1*triangle->z[1] + e2*triangle->z[2]) / area;
+            size_t pixel = (size_t)py*frame.width + px;
+            if (depth > raster_depth[pixel]) continue;
+            raster_depth[pixel] = depth;
+            raster_pixels[pixel] = triangle->color;
+        }
+    }
+}
 
-        pthread_barrier_wait(&updated_ref_barrier);
-        // Gravity
-        for (size_t index = data.from; index < data.to; ++index) {
-            if (!working_planets[index].active) continue;
-            Planet* planet = &working_planets[index];
+// Shaded as a sphere like the impostor shader, at the depth of its center
+static void raster_disc(const RasterDisc* disc, int x0, int y0, int x1, int y1) {
+    x0 = max(x0, (int)floorf(disc->x - disc->radious));
+    y0 = max(y0, (int)floorf(disc->y - disc->radious));
+    x1 = min(x1, (int)ceilf(disc->x + disc->radious));
+    y1 = min(y1, (int)ceilf(disc->y + disc->radious));
+
+    const float* rotation = frame.rotation;
+    for (int py = y0; py < y1; ++py) {
+        float dy = (py + 0.5f - disc->y) / disc->radious;
+        for (int px = x0; px < x1; ++px) {
+            float dx = (px + 0.5f - disc->x) / disc->radious;
+            float r2 = dx*dx + dy*dy;
+            if (r2 > 1) continue;
+
+            size_t pixel = (size_t)py*frame.width + px;
+            if (disc->z > raster_depth[pixel]) continue;
+            raster_depth[pixel] = disc->z;
+
+            float normal_z = -(dx*rotation[8] + dy*rotation[9] + sqrtf(1 - r2)*rotation[10]);
+            float light = (normal_z + AMBIENT_LIGHT)*BRIGHTNESS;
+            raster_pixels[pixel] = raster_rgba(disc->r*light, disc->g*light, disc->b*light);
+        }
+    }
+}
 
-            Vec3 total_force = vec3(0, 0, 0);
+void frame_raster(int part) {
+    if (!frame.draw) return;
+    int x0 = part%TILES_X*TILE_SIZE, y0 = part/TILES_X*TILE_SIZE;
+    if (x0 >= frame.width || y0 >= frame.height) return;
+    int x1 = min(x0 + TILE_SIZE, frame.width), y1 = min(y0 + TILE_SIZE, frame.height);
+
+    uint32_t clear = raster_rgba(0, 0, 0.05);
+    for (int y = y0; y < y1; ++y) {
+        for (int x = x0; x < x1; ++x) {
+            raster_pixels[(size_t)y*frame.width + x] = clear;
+            raster_depth[(size_t)y*frame.width + x] = 1;
+        }
+    }
 
-            for (size_t other_index = 0; other_index < PLANET_COUNT; ++other_index) {
-                Planet* other_planet = &ref_planets[other_index];
+    // Meshes first, then impostors, like GL
+    for (int bin = 0; bin < CORE_N; ++bin) {
+        RasterBatch* batch = &raster_batches[bin];
+        TileBin* triangles = &batch->triangle_bins[part];
+        for (size_t i = 0; i < triangles->count; ++i)
+            raster_triangle(&batch->triangles.items[triangles->items[i]], x0, y0, x1, y1);
+    }
+    for (int bin = 0; bin < CORE_N; ++bin) {
+        RasterBatch* batch = &raster_batches[bin];
+        TileBin* discs = &batch->disc_bins[part];
+        for (size_t i = 0; i < discs->count; ++i)
+            raster_disc(&batch->discs.items[discs->items[i]], x0, y0, x1, y1);
+    }
+}
 
-                if (other_index == index) continue;
-                if (!other_planet->active) continue;
+// Recording
+//
+// Frames are read back on the main thread into a small queue, and an
+// encoder thread writes them out: a numbered PNG per frame, or all of them
+// in a single Y4M stream when the path ends in .y4m. When the encoder falls
+// behind, the main thread waits for a free slot instead of dropping frames.
 
-                Vec3 difference = vec3_sub(other_planet->position, planet->position);
+#define RECORD_QUEUE 4
+#define RECORD_FPS 60
 
-                val_t square_distance = difference.x * difference.x
-                                    + difference.y * difference.y
-                                    + difference.z * difference.z;
+typedef struct {
+    const char* path;  // printf pattern for PNGs
+    bool y4m;
+    FILE* stream;      // Y4M only
+    int width, height;
+    int every;         // frames per recorded frame
+    unsigned char* frames[RECORD_QUEUE]; // RGBA, bottom row first like GL
+    int head, count;   // queued frames
+    int written;
+    bool closing;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_t thread;
+} Recorder;
+
+static inline void png_u32(unsigned char* out, uint32_t value) {
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+}
 
-                val_t distance = sqrt(square_distance);
-                val_t magnitude = G * (planet->mass * other_planet->mass) / square_distance;
+static void png_chunk(FILE* file, const char* type, const unsigned char* data, uint32_t size) {
+    unsigned char header[8];
+    png_u32(header, size);
+    memcpy(header+4, type, 4);
+    uint32_t crc = crc32(crc32(0, header+4, 4), data, size);
+    unsigned char footer[4];
+    png_u32(footer, crc);
+    fwrite(header, 1, 8, file);
+    fwrite(data, 1, size, file);
+    fwrite(footer, 1, 4, file);
+}
 
-                Vec3 gravitational_force = vec3(magnitude * (difference.x / distance),
-                                                magnitude * (difference.y / distance),
-                                                magnitude * (difference.z / distance));
+// 8 bit RGB, no filtering, the fastest zlib level. Time matters more than
+// size for a frame sequence.
+void png_write(const char* path, const unsigned char* rgba, int width, int height) {
+    size_t row = 1 + 3*(size_t)width;
+    unsigned char* raw = malloc(row*height);
+    for (int y = 0; y < height; ++y) {
+        const unsigned char* in = rgba + 4*(size_t)width*(height-1-y);
+        unsigned char* out = raw + row*y;
+        *out++ = 0;
+        for (int x = 0; x < width; ++x, in += 4, out += 3) {
+            out[0] = in[0];
+            out[1] = in[1];
+            out[2] = in[2];
+        }
+    }
+    uLongf size = compressBound(row*height);
+    unsigned char* compressed = malloc(size);
+    compress2(compressed, &size, raw, row*height, 1);
+
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        perror("Failed to write frame");
+        exit(1);
+    }
+    unsigned char header[13] = {0};
+    png_u32(header, width);
+    png_u32(header+4, height);
+    header[8] = 8; // bits per channel
+    header[9] = 2; // RGB
+    fwrite("\x89PNG\r\n\x1a\n", 1, 8, file);
+    png_chunk(file, "IHDR", header, sizeof(header));
+    png_chunk(file, "IDAT", compressed, size);
+    png_chunk(file, "IEND", NULL, 0);
+    fclose(file);
+    free(compressed);
+    free(raw);
+}
 
-                vec3_add_to(&total_force, gravitational_force);
+// BT.601 with full range levels like JPEG, chroma averaged over 2x2 pixels
+// so it sits between them, which is what C420jpeg in the header says
+void y4m_write_frame(FILE* file, const unsigned char* rgba, int width, int height) {
+    int chroma_width = (width+1)/2, chroma_height = (height+1)/2;
+    unsigned char* planes = malloc((size_t)width*height + 2*(size_t)chroma_width*chroma_height);
+    unsigned char* luma = planes;
+    unsigned char* cb = luma + (size_t)width*height;
+    unsigned char* cr = cb + (size_t)chroma_width*chroma_height;
+
+    for (int y = 0; y < height; ++y) {
+        const unsigned char* in = rgba + 4*(size_t)width*(height-1-y);
+        for (int x = 0; x < width; ++x, in += 4)
+            luma[(size_t)y*width + x] = (77*in[0] + 150*in[1] + 29*in[2] + 128) >> 8;
+    }
+    for (int y = 0; y < chroma_height; ++y) {
+        for (int x = 0; x < chroma_width; ++x) {
+            int r = 0, g = 0, b = 0;
+            for (int k = 0; k < 4; ++k) {
+                int px = min(2*x + k%2, width-1);
+                int py = min(2*y + k/2, height-1);
+                const unsigned char* in = rgba + 4*((size_t)width*(height-1-py) + px);
+                r += in[0];
+                g += in[1];
+                b += in[2];
             }
+            // Pure blue and red round up to 256
+            cb[(size_t)y*chroma_width + x] = min(((-43*r - 85*g + 128*b + 512) >> 10) + 128, 255);
+            cr[(size_t)y*chroma_width + x] = min(((128*r - 107*g - 21*b + 512) >> 10) + 128, 255);
+        }
+    }
+    fputs("FRAME\n", file);
+    fwrite(planes, 1, (size_t)width*height + 2*(size_t)chroma_width*chroma_height, file);
+    free(planes);
+}
 
-            vec3_div_by_s(&total_force, PLANET_COUNT);
-
-            Vec3 acceleration = vec3_div_s(total_force, working_planets[index].mass);
-            vec3_mult_by_s(&acceleration, (val_t)dt);
-            vec3_add_to(&working_planets[index].velocity, acceleration);
-            vec3_add_to(&working_planets[index].position, vec3_mult_s(working_planets[index].velocity, (val_t)dt));
+void* recorder_thread(void* arg) {
+    Recorder* recorder = arg;
+    pthread_mutex_lock(&recorder->lock);
+    while (true) {
+        while (recorder->count == 0 && !recorder->closing)
+            pthread_cond_wait(&recorder->changed, &recorder->lock);
+        if (recorder->count == 0) break;
+        unsigned char* pixels = recorder->frames[recorder->head];
+        pthread_mutex_unlock(&recorder->lock);
+
+        if (recorder->y4m) {
+            y4m_write_frame(recorder->stream, pixels, recorder->width, recorder->height);
+        } else {
+            char path[4096];
+            snprintf(path, sizeof(path), recorder->path, recorder->written);
+            png_write(path, pixels, recorder->width, recorder->height);
         }
 
-        //printf("finished gravity, waiting on barrier, thread from %d to %d\n", data.from, data.to);
-        pthread_barrier_wait(&end_barrier);
-        //printf("ending loop, thread from %d to %d \n", data.from, data.to);
+        pthread_mutex_lock(&recorder->lock);
+        recorder->written += 1;
+        recorder->head = (recorder->head + 1) % RECORD_QUEUE;
+        recorder->count -= 1;
+        pthread_cond_broadcast(&recorder->changed);
     }
+    pthread_mutex_unlock(&recorder->lock);
     return NULL;
 }
 
-pthread_t threads[CORE_N];
+void recorder_open(Recorder* recorder, const char* path, int width, int height, int every) {
+    size_t length = strlen(path);
+    recorder->path = path;
+    recorder->y4m = length >= 4 && strcmp(path + length - 4, ".y4m") == 0;
+    recorder->width = width;
+    recorder->height = height;
+    recorder->every = every;
+    for (int i = 0; i < RECORD_QUEUE; ++i) recorder->frames[i] = malloc(4*(size_t)width*height);
+
+    if (recorder->y4m) {
+        recorder->stream = fopen(path, "wb");
+        if (recorder->stream == NULL) {
+            perror("Failed to open recording");
+            exit(1);
+        }
+        // The frame rate the frames were recorded at, so the movie runs in real time
+        fprintf(recorder->stream, "YUV4MPEG2 W%d H%d F%d:%d Ip A1:1 C420jpeg XCOLORRANGE=FULL\n", width, height, RECORD_FPS, every);
+    }
+    pthread_mutex_init(&recorder->lock, NULL);
+    pthread_cond_init(&recorder->changed, NULL);
+    if (pthread_create(&recorder->thread, NULL, recorder_thread, recorder) != 0) {
+        perror("Failed to create thread");
+        exit(1);
+    }
+}
 
-int main() {
-    // Init planets
-    val_t fps;
-    val_t time_warping = 1000;
-    dt = 1/60 * time_warping;
-    
-    srand(22389238);
+// The slot for the next frame, waits for one if the queue is full
+unsigned char* recorder_acquire(Recorder* recorder) {
+    pthread_mutex_lock(&recorder->lock);
+    while (recorder->count == RECORD_QUEUE)
+        pthread_cond_wait(&recorder->changed, &recorder->lock);
+    unsigned char* pixels = recorder->frames[(recorder->head + recorder->count) % RECORD_QUEUE];
+    pthread_mutex_unlock(&recorder->lock);
+    return pixels;
+}
+
+void recorder_submit(Recorder* recorder) {
+    pthread_mutex_lock(&recorder->lock);
+    recorder->count += 1;
+    pthread_cond_broadcast(&recorder->changed);
+    pthread_mutex_unlock(&recorder->lock);
+}
 
-    CAD near_base_planet = cad_cube(1);
-    for (int i = 0; i < NEAR_PLANET_RES; ++i) cad_catmull_clark(&near_base_planet);
+// Writes out what's queued
+void recorder_close(Recorder* recorder) {
+    pthread_mutex_lock(&recorder->lock);
+    recorder->closing = true;
+    pthread_cond_broadcast(&recorder->changed);
+    pthread_mutex_unlock(&recorder->lock);
+    pthread_join(recorder->thread, NULL);
+
+    if (recorder->stream != NULL) fclose(recorder->stream);
+    for (int i = 0; i < RECORD_QUEUE; ++i) free(recorder->frames[i]);
+    printf("Recorded %d frames to %s\n", recorder->written, recorder->path);
+}
 
-    CAD far_base_planet = cad_cube(1);
-    for (int i = 0; i < FAR_PLANET_RES; ++i) cad_catmull_clark(&far_base_planet);
+// GL frames are read back through a ring of pixel buffer objects. The read
+// of this frame is only queued, and the one from CAPTURE_RING-1 frames ago,
+// done by now, is mapped and copied to the recorder. The main thread never
+// waits on the GPU for a capture.
 
-    val_t radious = randval() * MAX_RADIOUS;
-    val_t density = (MAX_DENSITY-MIN_DENSITY) * randval() +  MIN_DENSITY;
-    
-    for (int i = 0; i < PLANET_COUNT; ++i) {
-        working_planets[i].active = true;
-        working_planets[i].position.x = randval() * MAX_X;
-        working_planets[i].position.y = randval() * MAX_Y;
-        working_planets[i].position.z = randval() * MAX_Z;
+#define CAPTURE_RING 3
+
+GLuint capture_buffers[CAPTURE_RING];
+int capture_next;    // buffer for the next read
+int capture_pending; // reads not copied out yet
+
+void capture_init(int width, int height) {
+    glGenBuffers(CAPTURE_RING, capture_buffers);
+    for (int i = 0; i < CAPTURE_RING; ++i) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, capture_buffers[i]);
+        glBufferData(GL_PIXEL_PACK_BUFFER, 4*(size_t)width*height, NULL, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+// Copies the oldest pending read to the recorder
+void capture_collect(Recorder* recorder) {
+    int oldest = (capture_next - capture_pending + CAPTURE_RING) % CAPTURE_RING;
+    unsigned char* pixels = recorder_acquire(recorder);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, capture_buffers[oldest]);
+    void* mapped = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+    if (mapped != NULL) {
+        memcpy(pixels, mapped, 4*(size_t)recorder->width*recorder->height);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    } else {
+        memset(pixels, 0, 4*(size_t)recorder->width*recorder->height);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    recorder_submit(recorder);
+    capture_pending -= 1;
+}
+
+void capture_frame(Recorder* recorder) {
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, capture_buffers[capture_next]);
+    glReadPixels(0, 0, recorder->width, recorder->height, GL_RGBA, GL_UNSIGNED_BYTE, (void*)0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    capture_next = (capture_next + 1) % CAPTURE_RING;
+    capture_pending += 1;
+    if (capture_pending == CAPTURE_RING) capture_collect(recorder);
+}
+
+// The reads still in the ring, before the recorder closes
+void capture_flush(Recorder* recorder) {
+    while (capture_pending > 0) capture_collect(recorder);
+}
+
+// Offscreen
+//
+// Without a window, GL draws into a framebuffer object on a surfaceless
+// EGL context, so no X server is needed.
+
+void offscreen_init(int width, int height) {
+    EGLDisplay display = eglGetPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL)) {
+        fprintf(stderr, "Failed to open a surfaceless EGL display\n");
+        exit(1);
+    }
+    eglBindAPI(EGL_OPENGL_API);
+    EGLContext context = eglCreateContext(display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, NULL);
+    if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+        fprintf(stderr, "Failed to create an offscreen GL context\n");
+        exit(1);
+    }
+
+    GLuint framebuffer, renderbuffers[2];
+    glGenFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glGenRenderbuffers(2, renderbuffers);
+    glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+    glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        fprintf(stderr, "Failed to create an offscreen framebuffer\n");
+        exit(1);
+    }
+    printf("Offscreen: %s\n", glGetString(GL_RENDERER));
+}
 
-        working_planets[i].velocity.x = (randval()-0.5L)*2*MAX_VELOCITY;
-        working_planets[i].velocity.y = (randval()-0.5L)*2*MAX_VELOCITY;
-        working_planets[i].velocity.z = (randval()-0.5L)*2*MAX_VELOCITY;
+RGFW_window* frame_window; // NULL when offscreen
+Recorder* frame_recorder;  // NULL when not recording
+bool software_rendering;
+
+void frame_present(int part) {
+    if (!frame.draw) return;
+    if (software_rendering) {
+        frame_triangles = 0;
+        frame_impostors = 0;
+        for (int batch = 0; batch < CORE_N; ++batch) {
+            for (int res = 0; res < PLANET_LOD_LEVELS; ++res)
+                frame_triangles += planet_batches[batch][res].count*planet_lod_triangles[res];
+            frame_impostors += planet_batches[batch][IMPOSTOR_LIST].count;
+        }
+        if (frame_window != NULL) {
+            glWindowPos2i(0, 0);
+            glDrawPixels(frame.width, frame.height, GL_RGBA, GL_UNSIGNED_BYTE, raster_pixels);
+        }
+    }
+    // Before the swap, the back buffer is undefined after it
+    if (frame.record && software_rendering) {
+        unsigned char* pixels = recorder_acquire(frame_recorder);
+        memcpy(pixels, raster_pixels, (size_t)frame.width*frame.height*sizeof(uint32_t));
+        recorder_submit(frame_recorder);
+    } else if (frame.record) {
+        capture_frame(frame_recorder);
+    }
+    if (frame_window != NULL) RGFW_window_swapBuffers(frame_window);
+}
 
-        working_planets[i].acceleration = vec3(0, 0, 0);
+void frame_graph_init() {
+    FrameGraph* graph = &frame_graph;
+    int visibility = frame_job_add(graph, "visibility", frame_visibility,      CORE_N, 0,                false);
+    // Publishing overwrites what visibility reads
+    frame_job_add(graph, "simulate",                    frame_simulate,        1,      1u << visibility, false);
+    int instances  = frame_job_add(graph, "instances",  frame_instances_build, CORE_N, 1u << visibility, false);
+    if (software_rendering) {
+        int bin    = frame_job_add(graph, "bin",        frame_bin,             CORE_N,     1u << instances, false);
+        int raster = frame_job_add(graph, "raster",     frame_raster,          TILE_COUNT, 1u << bin,       false);
+        frame_job_add(graph, "present",                 frame_present,         1,          1u << raster,    true);
+    } else {
+        int submit = frame_job_add(graph, "submit",     frame_submit,          1,      1u << instances,  true);
+        frame_job_add(graph, "present",                 frame_present,         1,      1u << submit,     true);
+    }
 
-        working_planets[i].color.x = randval();
-        working_planets[i].color.y = randval();
-        working_planets[i].color.z = randval();
+    pthread_barrier_init(&frame_start_barrier, NULL, FRAME_HELPERS+1);
+    pthread_barrier_init(&frame_end_barrier, NULL, FRAME_HELPERS+1);
+    for (int i = 0; i < FRAME_HELPERS; ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, frame_helper_thread, NULL) != 0) {
+            perror("Failed to create thread");
+            exit(1);
+        }
+    }
+}
 
-        working_planets[i].radious = radious;
+void usage(char* program) {
+    fprintf(stderr, "Usage: %s [--scenario uniform|plummer|disk|binaries] [--seed N] [--diagnostics] [--no-sort]\n"
+                    "          [--procs K [--rank R] [--shm NAME]] [--batch FPS]\n"
+                    "          [--kernels baseline|sse4.2|avx2|avx512] [--regress STEPS] [--frame-timings]\n"
+                    "          [--frame-budget MS] [--offscreen] [--record FILE [--record-every N]] [--frames N]\n"
+                    "          [--software]\n", program);
+}
 
-        working_planets[i].mass = radious * density;
+int main(int argc, char** argv) {
+    int procs = 1;
+    int rank = -1;
+    char* shm_name = "/symc";
+    float batch_fps = 0;
+    Kernels requested_kernels = KERNELS_COUNT;
+    int regress_steps = 0;
+    bool frame_timings = false;
+    bool offscreen = false;
+    char* record_path = NULL;
+    int record_every = 1;
+    int frames = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--scenario") == 0 && i+1 < argc) {
+            char* name = argv[++i];
+            scenario = SCENARIO_COUNT;
+            for (int s = 0; s < SCENARIO_COUNT; ++s)
+                if (strcmp(name, scenario_names[s]) == 0) scenario = s;
+            if (scenario == SCENARIO_COUNT) {
+                fprintf(stderr, "Unknown scenario: %s\n", name);
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--seed") == 0 && i+1 < argc) {
+            seed = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--diagnostics") == 0) {
+            print_diagnostics = true;
+        } else if (strcmp(argv[i], "--no-sort") == 0) {
+            morton_sort = false;
+        } else if (strcmp(argv[i], "--procs") == 0 && i+1 < argc) {
+            procs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--rank") == 0 && i+1 < argc) {
+            rank = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--shm") == 0 && i+1 < argc) {
+            shm_name = argv[++i];
+        } else if (strcmp(argv[i], "--batch") == 0 && i+1 < argc) {
+            batch_fps = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--regress") == 0 && i+1 < argc) {
+            regress_steps = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--frame-budget") == 0 && i+1 < argc) {
+            load_shedding.budget = atof(argv[++i]) / 1000;
+        } else if (strcmp(argv[i], "--frame-timings") == 0) {
+            frame_timings = true;
+        } else if (strcmp(argv[i], "--offscreen") == 0) {
+            offscreen = true;
+        } else if (strcmp(argv[i], "--record") == 0 && i+1 < argc) {
+            record_path = argv[++i];
+        } else if (strcmp(argv[i], "--record-every") == 0 && i+1 < argc) {
+            record_every = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--frames") == 0 && i+1 < argc) {
+            frames = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--software") == 0) {
+            software_rendering = true;
+        } else if (strcmp(argv[i], "--kernels") == 0 && i+1 < argc) {
+            char* name = argv[++i];
+            requested_kernels = KERNELS_COUNT;
+            for (int k = 0; k < KERNELS_COUNT; ++k)
+                if (strcmp(name, kernels_names[k]) == 0) requested_kernels = k;
+            if (requested_kernels == KERNELS_COUNT || !kernels_supported(requested_kernels)) {
+                fprintf(stderr, "Unknown or unsupported kernels: %s\n", name);
+                usage(argv[0]);
+                return 1;
+            }
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (procs < 1 || procs > PLANET_COUNT || rank >= procs || batch_fps < 0 || load_shedding.budget < 0 || regress_steps < 0 || (regress_steps > 0 && procs > 1) ||
+        record_every < 1 || frames < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    printf("Scenario: %s, seed: %llu\n", scenario_names[scenario], (unsigned long long)seed);
+    kernels_select(requested_kernels);
+    printf("Bodies: %zu bytes for the physics, %zu more for the rest\n", sizeof(Planet), sizeof(PlanetInfo));
+
+    // Without an explicit rank, this process is rank 0 and starts the others
+    pid_t children[procs];
+    int children_count = 0;
+    if (procs > 1 && rank < 0) {
+        rank = 0;
+        fflush(stdout);
+        for (int r = 1; r < procs; ++r) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                rank = r;
+                children_count = 0;
+                break;
+            }
+            if (pid < 0) {
+                perror("Failed to start process");
+                return 1;
+            }
+            children[children_count++] = pid;
+        }
+    }
+    if (rank < 0) rank = 0;
+
+    if (procs > 1) {
+        // Slices belong to ranks, bodies can't move between them
+        morton_sort = false;
+        // Channels fit the largest message, a slice of per body records or
+        // one rank's diagnostics, which is bigger than a slice of few bodies
+        size_t slice_bytes = (PLANET_COUNT/procs + PLANET_COUNT%procs)*max(sizeof(Planet), sizeof(PlanetInfo));
+        transport = shm_transport_open(shm_name, rank, procs, max(slice_bytes, sizeof(Diagnostics)));
+        slice_bounds(PLANET_COUNT, procs, rank, &rank_from, &rank_to);
+        printf("Rank %d of %d owns %d to %d\n", rank, procs, rank_from, rank_to);
     }
 
-    memcpy(ref_planets, working_planets, PLANET_COUNT*sizeof(Planet));
+    // Init planets
+    val_t time_warping = TIME_WARPING;
 
-    CAD obj = cad_clone(near_base_planet);
+    planet_bases[0] = cad_cube(1);
+    for (int i = 1; i < PLANET_LOD_LEVELS; ++i) {
+        planet_bases[i] = cad_clone(planet_bases[i-1]);
+        cad_catmull_clark(&planet_bases[i]);
+    }
+    for (int i = 0; i < PLANET_LOD_LEVELS; ++i) cad_compute_normals(&planet_bases[i]);
+    planet_lods_init();
+    quality = qualities[0];
+
+    // The stream past the last body is reserved for the shared parameters
+    RNG rng = rng_stream(seed, PLANET_COUNT);
+    initial_radious = rng_val(&rng) * MAX_RADIOUS;
+    initial_density = (MAX_DENSITY-MIN_DENSITY) * rng_val(&rng) +  MIN_DENSITY;
     
     // Threading
-    pthread_barrier_init(&end_barrier, NULL, CORE_N);
-    pthread_barrier_init(&collision_barrier, NULL, CORE_N+1);
+    pthread_barrier_init(&init_barrier, NULL, CORE_N+1);
+    pthread_barrier_init(&end_barrier, NULL, CORE_N+1);
     pthread_barrier_init(&start_collision_barrier, NULL, CORE_N+1);
-    pthread_barrier_init(&updated_ref_barrier, NULL, CORE_N+1);
+    pthread_barrier_init(&published_barrier, NULL, CORE_N+1);
+    pthread_barrier_init(&collision_barrier, NULL, CORE_N);
+    pthread_barrier_init(&updated_ref_barrier, NULL, CORE_N);
+    pthread_barrier_init(&step_barrier, NULL, CORE_N);
+    pthread_barrier_init(&bvh_barrier, NULL, CORE_N);
+    pthread_barrier_init(&sort_barrier, NULL, CORE_N);
+    pthread_barrier_init(&gravity_barrier, NULL, CORE_N);
 
-    int step      = (PLANET_COUNT/(CORE_N));
-    int remainder = (PLANET_COUNT%CORE_N);
+    int step      = ((rank_to - rank_from)/(CORE_N));
+    int remainder = ((rank_to - rank_from)%CORE_N);
 
     for (int i = 0; i < CORE_N; ++i) {
         PlanetsThreadData* data = malloc(sizeof(PlanetsThreadData));
-        data->from = i * step;
+        data->thread_index = i;
+        data->from = rank_from + i * step;
         if (i == CORE_N-1 && remainder != 0) {
             data->to = data->from + step + remainder;
         } else {
@@ -250,30 +3321,98 @@ int main() {
             return 1;
         }
     }
+    // Every worker initializes its own slice
+    pthread_barrier_wait(&init_barrier);
+    exchange_planet_info();
     // End threading
 
+    if (regress_steps > 0) {
+        regress(regress_steps);
+        return 0;
+    }
+
+    // Only rank 0 gets a window
+    if (rank > 0) {
+        print_diagnostics = false;
+        for (size_t step = 0;;) step += simulation_steps(step, 1);
+    }
+
 
     // Init rendering:
     float pitch=31.0, yaw=230.0;
+    size_t sim_step = 0;
+    double accumulator = 0;
+    struct timespec last_frame;
+    clock_gettime(CLOCK_MONOTONIC, &last_frame);
+
+    int batch_count = 1;
+    struct timespec batch_report = last_frame;
+    int batch_report_frames = 0;
+    size_t batch_report_step = 0;
+    struct timespec frame_report = last_frame;
+    int frame_report_frames = 0;
+    long frame_report_active = 0;
+    long frame_report_culled = 0;
+    long frame_report_triangles = 0;
+    long frame_report_impostors = 0;
+    int frame_report_drawn = 0;
+    uint64_t frame_report_physics[PHYSICS_PHASES] = {0};
+    uint64_t frame_report_interactions = 0;
+    uint64_t frame_report_bytes = 0;
     float camX=-1000, camZ=500, camY=-1000;
 
-    RGFW_window* win = RGFW_createWindow("Cadigo Visualizer", RGFW_RECT(0, 0, 800, 450), RGFW_windowCenter | RGFW_windowNoResize );
+    // Software rendering offscreen needs no GL at all
+    RGFW_window* win = NULL;
+    if (offscreen) {
+        if (!software_rendering) offscreen_init(FRAME_WIDTH, FRAME_HEIGHT);
+    } else {
+        win = RGFW_createWindow("Cadigo Visualizer", RGFW_RECT(0, 0, FRAME_WIDTH, FRAME_HEIGHT), RGFW_windowCenter | RGFW_windowNoResize );
+        RGFW_window_showMouse(win, 0);
+    }
+    frame_window = win;
 
-    RGFW_window_showMouse(win, 0);
-    glEnable(GL_DEPTH_TEST);
-    glDepthFunc(GL_LEQUAL);
-    glMatrixMode(GL_PROJECTION);
-    glClearColor(0.0f, 0.0f, 0.05f, 1.0f);
-    glLoadIdentity();
-    cad_viz_glPerspective(60, 16.0 / 9.0, 1, 1000000);
-    glMatrixMode(GL_MODELVIEW);
+    Recorder recorder = {0};
+    if (record_path != NULL) {
+        recorder_open(&recorder, record_path, FRAME_WIDTH, FRAME_HEIGHT, record_every);
+        frame_recorder = &recorder;
+    }
+
+    if (software_rendering) {
+        raster_init();
+    } else {
+        glEnable(GL_DEPTH_TEST);
+        glDepthFunc(GL_LEQUAL);
+        glMatrixMode(GL_PROJECTION);
+        glClearColor(0.0f, 0.0f, 0.05f, 1.0f);
+        glLoadIdentity();
+        cad_viz_glPerspective(FOV_Y, 16.0 / 9.0, 1, 1000000);
+        glMatrixMode(GL_MODELVIEW);
+
+        planet_meshes_init();
+        if (frame_recorder != NULL) capture_init(FRAME_WIDTH, FRAME_HEIGHT);
+    }
 
+    // The first frame draws the first step, every frame after it draws what
+    // the one before simulated
+    sim_step += simulation_steps(sim_step, 1);
+    frame_graph_init();
 
 
-    RGFW_window_mouseHold(win, RGFW_AREA(win->r.w / 2, win->r.h / 2));    
-    while (RGFW_window_shouldClose(win) == 0) {
+    if (win != NULL) RGFW_window_mouseHold(win, RGFW_AREA(win->r.w / 2, win->r.h / 2));    
+    for (int frame_number = 0; frames == 0 || frame_number < frames; ++frame_number) {
+        if (win != NULL && RGFW_window_shouldClose(win)) break;
         //puts("--------");
-        while (RGFW_window_checkEvent(win)) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double frame_time = (now.tv_sec - last_frame.tv_sec) + (now.tv_nsec - last_frame.tv_nsec)*1e-9;
+        last_frame = now;
+        // Offscreen runs go by the frame rate of the recording, however long
+        // the frames take to make
+        if (offscreen) frame_time = 1.0/RECORD_FPS;
+        // The camera keeps the same speed whatever the warp
+        val_t frame_dt = frame_time * TIME_WARPING;
+
+        while (win != NULL && RGFW_window_checkEvent(win)) {
             if (win->event.type == RGFW_quit) goto close_and_return;
 
             switch (win->event.type) {
@@ -304,6 +3443,9 @@ int main() {
                         case RGFW_right:  yaw += 5; break;
                         case RGFW_up:   pitch -= 5; break;
                         case RGFW_down: pitch += 5; break;
+
+                        case RGFW_equals: time_warping *= 2; printf("Time warping: %g\n", time_warping); break;
+                        case RGFW_minus:  time_warping /= 2; printf("Time warping: %g\n", time_warping); break;
                         default: break;
                     }
                     break;
@@ -313,112 +3455,148 @@ int main() {
         }
 
         if (RGFW_isPressed(win, RGFW_w)) {
-            camX += cos((yaw + 90) * DEG2RAD)*CAM_VELOCITY*dt;
-            camZ -= sin((yaw + 90) * DEG2RAD)*CAM_VELOCITY*dt;
+            camX += cos((yaw + 90) * DEG2RAD)*CAM_VELOCITY*frame_dt;
+            camZ -= sin((yaw + 90) * DEG2RAD)*CAM_VELOCITY*frame_dt;
         }
         if (RGFW_isPressed(win, RGFW_s)) {
-            camX += cos((yaw + 270) * DEG2RAD)*CAM_VELOCITY*dt;
-            camZ -= sin((yaw + 270) * DEG2RAD)*CAM_VELOCITY*dt;
+            camX += cos((yaw + 270) * DEG2RAD)*CAM_VELOCITY*frame_dt;
+            camZ -= sin((yaw + 270) * DEG2RAD)*CAM_VELOCITY*frame_dt;
         }
         if (RGFW_isPressed(win, RGFW_a)) {
-            camX += cos(yaw * DEG2RAD)*CAM_VELOCITY*dt;
-            camZ -= sin(yaw * DEG2RAD)*CAM_VELOCITY*dt;
+            camX += cos(yaw * DEG2RAD)*CAM_VELOCITY*frame_dt;
+            camZ -= sin(yaw * DEG2RAD)*CAM_VELOCITY*frame_dt;
         }
         if (RGFW_isPressed(win, RGFW_d)) {
-            camX += cos((yaw + 180) * DEG2RAD)*CAM_VELOCITY*dt;
-            camZ -= sin((yaw + 180) * DEG2RAD)*CAM_VELOCITY*dt;
+            camX += cos((yaw + 180) * DEG2RAD)*CAM_VELOCITY*frame_dt;
+            camZ -= sin((yaw + 180) * DEG2RAD)*CAM_VELOCITY*frame_dt;
         }
 
-        if (RGFW_isPressed(win, RGFW_space))  camY -= CAM_VELOCITY*dt;
-        if (RGFW_isPressed(win, RGFW_shiftL)) camY += CAM_VELOCITY*dt;
+        if (RGFW_isPressed(win, RGFW_space))  camY -= CAM_VELOCITY*frame_dt;
+        if (RGFW_isPressed(win, RGFW_shiftL)) camY += CAM_VELOCITY*frame_dt;
         
         float rot_sensitivity = 0.03;
 
-        if (RGFW_isPressed(win, RGFW_h)) yaw   -= rot_sensitivity*dt;
-        if (RGFW_isPressed(win, RGFW_l)) yaw   += rot_sensitivity*dt;
-        if (RGFW_isPressed(win, RGFW_j)) pitch += rot_sensitivity*dt;
-        if (RGFW_isPressed(win, RGFW_k)) pitch -= rot_sensitivity*dt;
+        if (RGFW_isPressed(win, RGFW_h)) yaw   -= rot_sensitivity*frame_dt;
+        if (RGFW_isPressed(win, RGFW_l)) yaw   += rot_sensitivity*frame_dt;
+        if (RGFW_isPressed(win, RGFW_j)) pitch += rot_sensitivity*frame_dt;
+        if (RGFW_isPressed(win, RGFW_k)) pitch -= rot_sensitivity*frame_dt;
 
 
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        glLoadIdentity();
-
         // Update camera
         if      (pitch >=  70) pitch = 70;
         else if (pitch <= -60) pitch = -60;
-        glRotatef(pitch, 1.0, 0.0, 0.0);
-        glRotatef(yaw  , 0.0, 1.0, 0.0); 
-        glTranslatef(camX, camY, -camZ);
-
-        memcpy(ref_planets, working_planets, PLANET_COUNT*sizeof(Planet));
-        pthread_barrier_wait(&start_collision_barrier);
-
-        //puts("Handling collisions");
-        pthread_barrier_wait(&collision_barrier);
-
-        memcpy(ref_planets, working_planets, PLANET_COUNT*sizeof(Planet));
-
-        pthread_barrier_wait(&updated_ref_barrier);
-
-
-
-        glViewport(0, 0, win->r.w, win->r.h);
-        glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-        for (size_t h = 0; h < PLANET_COUNT; ++h) {
-            if (!ref_planets[h].active) continue;
-
-            Vec3 difference = vec3_sub(ref_planets[h].position, vec3(-camX, -camY, camZ));
-
-            val_t square_distance = difference.x * difference.x
-                                  + difference.y * difference.y
-                                  + difference.z * difference.z;
-
-            float distance_to_camera = sqrt(square_distance);
-
-            float ambient_light = 1.5;
-            float brightness = 0.20;
-
-            if (distance_to_camera < LOD_LIMIT) {
-                cad_clone_into(near_base_planet, &obj); 
-            } else {
-                cad_clone_into(far_base_planet, &obj); 
+        frame.camera = vec3(-camX, -camY, camZ);
+        frame.pitch = pitch;
+        frame.yaw = yaw;
+        frame.width = win != NULL ? win->r.w : FRAME_WIDTH;
+        frame.height = win != NULL ? win->r.h : FRAME_HEIGHT;
+        // Offscreen, frames that aren't recorded only simulate
+        frame.record = frame_recorder != NULL && frame_number % record_every == 0;
+        frame.draw = !offscreen || frame_number % record_every == 0;
+        frame_frustum_update(&frame);
+
+        // What this frame simulates shows up in the next one, the blend
+        // factor goes along with it
+        val_t alpha = 1;
+        if (batch_fps > 0) {
+            // Fill a frame at the target rate with steps, going by how long
+            // the last batch took. The workers run it while the next frame draws.
+            int ideal = step_seconds > 0 ? (int)min(1.0/(batch_fps*step_seconds), MAX_BATCH_STEPS) : 1;
+            batch_count = max((batch_count + ideal + 1)/2, 1);
+            frame.sim_count = batch_count;
+
+            batch_report_frames += 1;
+            if (now.tv_sec > batch_report.tv_sec) {
+                double seconds = (now.tv_sec - batch_report.tv_sec) + (now.tv_nsec - batch_report.tv_nsec)*1e-9;
+                printf("Batch: %d steps per frame, %.1f frames/s, %.0f steps/s\n",
+                       batch_count, batch_report_frames/seconds, (sim_step - batch_report_step)/seconds);
+                batch_report = now;
+                batch_report_frames = 0;
+                batch_report_step = sim_step;
             }
-            cad_scale_s(&obj, ref_planets[h].radious*2);
-            cad_translate(&obj, ref_planets[h].position);
-
-            for (size_t i = 0; i < obj.faces.count; ++i) {
-
-                Face face = obj.faces.items[i];
-                if (face.count < 3) continue;  // Skip invalid faces
-                Vec3 normal = cad_calculate_face_normal(obj, i);
+        } else {
+            // Run the fixed steps that fit in the time that passed, as one
+            // batch so the jobs reading the published state don't see it
+            // change under them. Whatever is over the cap is dropped, so a
+            // slow frame can't snowball.
+            accumulator += frame_time * time_warping;
+            frame.sim_count = 0;
+            for (int k = 0; k < load_shedding.max_steps && accumulator >= SIM_DT; ++k) {
+                frame.sim_count += 1;
+                accumulator -= SIM_DT;
+            }
+            if (accumulator >= SIM_DT) accumulator = fmod(accumulator, SIM_DT);
 
-                float lighting = (normal.z+ambient_light) * brightness * max(1.0-(distance_to_camera*0.0001), 0.2);
+            // Blend from the second to last published state towards the last one
+            alpha = accumulator / SIM_DT;
+        }
+        frame.sim_step = sim_step;
+        frame.bodies = render_bodies[render_published];
+        frame.previous_bodies = render_bodies[1-render_published];
 
-                glBegin(GL_POLYGON);
-                    glColor3f(ref_planets[h].color.x * lighting,
-                              ref_planets[h].color.y * lighting,
-                              ref_planets[h].color.z * lighting);
+        frame_graph_run(&frame_graph);
+        sim_step = frame.sim_step;
+        frame.alpha = alpha;
 
+        if (load_shedding.budget > 0) {
+            load_shedding_update(&load_shedding, &frame_graph, batch_fps == 0);
+            quality = qualities[load_shedding.level];
+        }
 
-                    for (size_t j = 0; j < face.count; ++j) {
-                        Vec3 v = obj.points.items[face.items[j]];
-                        glVertex3f(v.x, v.y, v.z);
-                    }
-                glEnd();
+        frame_report_frames += 1;
+        frame_report_drawn += frame.draw;
+        for (int part = 0; part < CORE_N; ++part) {
+            frame_report_active += frame_active[part];
+            frame_report_culled += frame_culled[part];
+        }
+        if (frame.draw) {
+            frame_report_triangles += frame_triangles;
+            frame_report_impostors += frame_impostors;
+        }
+        if (frame_timings && now.tv_sec > frame_report.tv_sec) {
+            double seconds = (now.tv_sec - frame_report.tv_sec) + (now.tv_nsec - frame_report.tv_nsec)*1e-9;
+            frame_graph_report(&frame_graph, frame_report_frames, seconds);
+            // Inside simulate, as the physics workers run them
+            printf("Physics:");
+            for (int phase = 0; phase < PHYSICS_PHASES; ++phase) {
+                uint64_t total = atomic_load_explicit(&physics_nanoseconds[phase], memory_order_relaxed);
+                printf("%s %s %.2f ms", phase == 0 ? "" : ",", physics_phase_names[phase], (total - frame_report_physics[phase])*1e-6/frame_report_frames);
+                frame_report_physics[phase] = total;
             }
+            uint64_t interactions = atomic_load_explicit(&gravity_interactions, memory_order_relaxed);
+            uint64_t bytes = atomic_load_explicit(&gravity_bytes, memory_order_relaxed);
+            if (interactions > frame_report_interactions) {
+                printf(", %.1f B per interaction%s", (double)(bytes - frame_report_bytes)/(interactions - frame_report_interactions),
+                       perf_counting ? "" : " (estimated)");
+            }
+            frame_report_interactions = interactions;
+            frame_report_bytes = bytes;
+            printf("\n");
+            printf("Culled: %.1f%% of %.0f bodies outside the view, %.0f triangles and %.0f points drawn\n",
+                   frame_report_active > 0 ? 100.0*frame_report_culled/frame_report_active : 0.0,
+                   (double)frame_report_active/max(frame_report_drawn, 1), (double)frame_report_triangles/max(frame_report_drawn, 1),
+                   (double)frame_report_impostors/max(frame_report_drawn, 1));
+            frame_report = now;
+            frame_report_frames = 0;
+            frame_report_active = 0;
+            frame_report_culled = 0;
+            frame_report_triangles = 0;
+            frame_report_impostors = 0;
+            frame_report_drawn = 0;
         }
 
-        RGFW_window_swapBuffers(win);
-
-
-        fps = RGFW_window_checkFPS(win, 60);
-        //printf("\033[K");
-        //printf("FPS: %f\n", fps);
-        if (fps > 0) dt = (1/fps) * time_warping; 
+        if (win != NULL) RGFW_window_checkFPS(win, 60);
     }
 
 close_and_return:
 
-    RGFW_window_close(win);
+    if (frame_recorder != NULL) {
+        if (!software_rendering) capture_flush(frame_recorder);
+        recorder_close(frame_recorder);
+    }
+    if (win != NULL) RGFW_window_close(win);
+    simulation_finish();
+    if (transport != NULL) transport->close(transport);
+    for (int i = 0; i < children_count; ++i) waitpid(children[i], NULL, 0);
     return 0;
 }